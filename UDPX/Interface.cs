@@ -2,6 +2,7 @@
 using System.Collections.Generic;
 using System.Net;
 using System.Net.Sockets;
+using System.Security.Cryptography;
 using System.Timers;
 
 /// <summary>
@@ -101,7 +102,7 @@ public static class UDPX
     {
         // Create sequence number
         int seq = _CreateInitialSequence();
-        byte[] handshake = new byte[5];
+        byte[] handshake = new byte[_HandshakeSize];
         handshake[0] = (byte)PacketType.Handshake;
         _WriteInt(seq, handshake, 1);
 
@@ -170,10 +171,11 @@ public static class UDPX
                 {
                     if (From.Equals(EndPoint))
                     {
-                        if (Data.Length == 5 && Data[0] == (byte)PacketType.HandshakeAck)
+                        if (Data.Length == _HandshakeAckSize && Data[0] == (byte)PacketType.HandshakeAck && _ReadInt(Data, 9) == seq)
                         {
                             int recvseq = _ReadInt(Data, 1);
-                            _ClientConnection cc = new _ClientConnection(seq, recvseq, cli, EndPoint);
+                            int id = _ReadInt(Data, 5);
+                            _ClientConnection cc = new _ClientConnection(id, seq, recvseq, cli, EndPoint);
                             OnConnect(cc);
 
                             // Give the new connection the messages intended for it
@@ -182,6 +184,8 @@ public static class UDPX
                                 cc.ReceiveRaw(qdata);
                             }
 
+                            // Only now, or a packet already waiting could be taken before the handler's hooked up
+                            cc._BeginListen();
                             OnConnect = null;
                         }
                         else
@@ -217,6 +221,21 @@ public static class UDPX
         return _Random.Next(int.MinValue, 0);
     }
 
+    /// <summary>
+    /// Random number generator for connection ids, which must not be guessable since they identify a session.
+    /// </summary>
+    private static RandomNumberGenerator _SecureRandom = RandomNumberGenerator.Create();
+
+    /// <summary>
+    /// Creates a random connection id.
+    /// </summary>
+    private static int _CreateConnectionID()
+    {
+        byte[] bytes = new byte[4];
+        _SecureRandom.GetBytes(bytes);
+        return BitConverter.ToInt32(bytes, 0);
+    }
+
     /// <summary>
     /// Sends a packet with the given end point.
     /// </summary>
@@ -329,9 +348,24 @@ public static class UDPX
     public const int MaxPacketSize = 65536 - _PacketHeaderSize;
 
     /// <summary>
-    /// Gets the size a header for a normal packet.
+    /// Gets the size a header for a normal packet (type, connection id, sequence, receive sequence).
+    /// </summary>
+    private const int _PacketHeaderSize = 1 + 4 + 4 + 4;
+
+    /// <summary>
+    /// Gets the size of the header for an unsequenced packet (type, connection id).
+    /// </summary>
+    private const int _UnsequencedHeaderSize = 1 + 4;
+
+    /// <summary>
+    /// Gets the size of a handshake (type, initial sequence).
+    /// </summary>
+    private const int _HandshakeSize = 1 + 4;
+
+    /// <summary>
+    /// Gets the size of a handshake ack (type, initial sequence, connection id, echoed initial sequence, early data accepted).
     /// </summary>
-    private const int _PacketHeaderSize = 1 + 4 + 4;
+    private const int _HandshakeAckSize = 1 + 4 + 4 + 4 + 1;
 
     /// <summary>
     /// Listens for an incoming connection on a port.
@@ -341,7 +375,8 @@ public static class UDPX
         public Listener(int Port, ConnectHandler OnConnect)
         {
             this._Client = new UdpClient(Port);
-            this._Connections = new Dictionary<IPEndPoint, _LConnection>();
+            this._Connections = new Dictionary<int, _LConnection>();
+            this._Handshakes = new Dictionary<KeyValuePair<IPEndPoint, int>, _LConnection>();
             this._OnConnect = OnConnect;
             this._BeginListen();
         }
@@ -361,11 +396,12 @@ public static class UDPX
         }
 
         /// <summary>
-        /// Disconnects the connection with the specified endpoint.
+        /// Disconnects the specified connection.
         /// </summary>
-        internal void _Disconnect(IPEndPoint EndPoint)
+        private void _Disconnect(_LConnection Connection)
         {
-            this._Connections.Remove(EndPoint);
+            this._Connections.Remove(Connection.ConnectionID);
+            this._Handshakes.Remove(new KeyValuePair<IPEndPoint, int>(Connection.EndPoint, Connection.InitialReceiveSequence));
         }
 
         private void _BeginListen()
@@ -376,34 +412,47 @@ public static class UDPX
         private void _ReceiveCallback(IPEndPoint From, byte[] Data)
         {
             _LConnection conn;
-            if (this._Connections.TryGetValue(From, out conn))
-            {
-                conn.ReceiveRaw(Data);
-            }
-            else
+            if (Data.Length == _HandshakeSize && Data[0] == (byte)PacketType.Handshake)
             {
-                if (Data.Length == 5 && Data[0] == (byte)PacketType.Handshake)
+                // A retransmitted handshake (our ack got lost) gets the same connection back
+                int recvseq = _ReadInt(Data, 1);
+                KeyValuePair<IPEndPoint, int> key = new KeyValuePair<IPEndPoint, int>(From, recvseq);
+                if (this._Handshakes.TryGetValue(key, out conn))
                 {
-                    int seq = _CreateInitialSequence();
-                    int recvseq = _ReadInt(Data, 1);
-                    byte[] handshakeack = new byte[5];
-                    handshakeack[0] = (byte)PacketType.HandshakeAck;
-                    _WriteInt(seq, handshakeack, 1);
+                    conn.ReceiveRaw(Data);
+                }
+                else
+                {
+                    int id;
+                    do
+                    {
+                        id = _CreateConnectionID();
+                    }
+                    while (id == 0 || this._Connections.ContainsKey(id));
 
-                    Send(this._Client, From, handshakeack);
-                    _LConnection connection = new _LConnection(seq, recvseq, From, this, this._Client);
-                    this._Connections[From] = connection;
+                    _LConnection connection = new _LConnection(id, _CreateInitialSequence(), recvseq, From, this, this._Client);
+                    this._Connections[id] = connection;
+                    this._Handshakes[key] = connection;
+                    connection.ReceiveRaw(Data); // Sends the HandshakeAck
                     this._OnConnect(connection);
                 }
             }
+            else if (Data.Length >= _UnsequencedHeaderSize)
+            {
+                // Everything else carries the connection id straight after the type
+                if (this._Connections.TryGetValue(_ReadInt(Data, 1), out conn) && conn.EndPoint.Equals(From))
+                {
+                    conn.ReceiveRaw(Data);
+                }
+            }
             this._BeginListen();
         }
 
         
         private class _LConnection : _Connection
         {
-            public _LConnection(int InitialSequence, int InitialReceiveSequence, IPEndPoint EndPoint, Listener Listener, UdpClient SendClient)
-                : base(InitialSequence, InitialReceiveSequence)
+            public _LConnection(int ConnectionID, int InitialSequence, int InitialReceiveSequence, IPEndPoint EndPoint, Listener Listener, UdpClient SendClient)
+                : base(ConnectionID, InitialSequence, InitialReceiveSequence)
             {
                 this._EndPoint = EndPoint;
                 this._SendClient = SendClient;
@@ -425,7 +474,7 @@ public static class UDPX
 
             public override void OnDispose()
             {
-                this._Listener._Disconnect(this._EndPoint);
+                this._Listener._Disconnect(this);
             }
 
             private IPEndPoint _EndPoint;
@@ -433,7 +482,8 @@ public static class UDPX
             private UdpClient _SendClient;
         }
 
-        private Dictionary<IPEndPoint, _LConnection> _Connections;
+        private Dictionary<int, _LConnection> _Connections;
+        private Dictionary<KeyValuePair<IPEndPoint, int>, _LConnection> _Handshakes; // By client and its initial sequence
         private ConnectHandler _OnConnect;
         private UdpClient _Client;
     }
@@ -451,11 +501,13 @@ public static class UDPX
     /// </summary>
     private abstract class _Connection : IUDPXConnection
     {
-        public _Connection(int InitialSequence, int InitialReceiveSequence)
+        public _Connection(int ConnectionID, int InitialSequence, int InitialReceiveSequence)
         {
             this._Received = new Dictionary<int, byte[]>();
             this._Sent = new Dictionary<int, byte[]>();
 
+            this._ConnectionID = ConnectionID;
+            this._InitialReceiveSequence = InitialReceiveSequence;
             this._ReceiveSequence = this._LastReceiveSequence = InitialReceiveSequence;
             this._SendSequence = this._InitialSequence = InitialSequence;
         }
@@ -465,12 +517,35 @@ public static class UDPX
         /// </summary>
         private const int _SequenceWindow = 128;
 
+        /// <summary>
+        /// Gets the id the listener gave this connection, which every packet but the handshake carries.
+        /// </summary>
+        internal int ConnectionID
+        {
+            get
+            {
+                return this._ConnectionID;
+            }
+        }
+
+        /// <summary>
+        /// Gets the initial sequence the client sent in its handshake.
+        /// </summary>
+        internal int InitialReceiveSequence
+        {
+            get
+            {
+                return this._InitialReceiveSequence;
+            }
+        }
+
         public void Disconnect()
         {
             byte[] pdata = new byte[ _PacketHeaderSize];
             pdata[0] = (byte)PacketType.Disconnect;
-            _WriteInt(this._SendSequence, pdata, 1);
-            _WriteInt(this._ReceiveSequence, pdata, 5);
+            _WriteInt(this._ConnectionID, pdata, 1);
+            _WriteInt(this._SendSequence, pdata, 5);
+            _WriteInt(this._ReceiveSequence, pdata, 9);
             this.SendRaw(pdata);
             this.Dispose();
         }
@@ -577,8 +652,9 @@ public static class UDPX
         {
             byte[] pdata = new byte[Data.Length + _PacketHeaderSize];
             pdata[0] = (byte)PacketType.Sequenced;
-            _WriteInt(Sequence, pdata, 1);
-            _WriteInt(this._ReceiveSequence, pdata, 5);
+            _WriteInt(this._ConnectionID, pdata, 1);
+            _WriteInt(Sequence, pdata, 5);
+            _WriteInt(this._ReceiveSequence, pdata, 9);
             for (int t = 0; t < Data.Length; t++)
             {
                 pdata[t + _PacketHeaderSize] = Data[t];
@@ -592,10 +668,12 @@ public static class UDPX
         /// </summary>
         private void _SendKeepAlive()
         {
-            byte[] pdata = new byte[_PacketHeaderSize];
+            byte[] pdata = new byte[_PacketHeaderSize + 4];
             pdata[0] = (byte)PacketType.KeepAlive;
-            _WriteInt(this._SendSequence - 1, pdata, 1);
-            _WriteInt(this._ReceiveSequence, pdata, 5);
+            _WriteInt(this._ConnectionID, pdata, 1);
+            _WriteInt(this._SendSequence - 1, pdata, 5);
+            _WriteInt(this._ReceiveSequence, pdata, 9);
+            _WriteInt(++this._KeepAliveCount, pdata, 13); // So UDPXLib can tell it from a copy of an older one
             this._ResetKeepAlive();
             this.SendRaw(pdata);
         }
@@ -605,19 +683,21 @@ public static class UDPX
         /// </summary>
         private void _SendRequest(int Sequence)
         {
-            byte[] pdata = new byte[5];
+            byte[] pdata = new byte[1 + 4 + 4];
             pdata[0] = (byte)PacketType.Request;
-            _WriteInt(Sequence, pdata, 1);
+            _WriteInt(this._ConnectionID, pdata, 1);
+            _WriteInt(Sequence, pdata, 5);
             this.SendRaw(pdata);
         }
 
         public void SendUnchecked(byte[] Data)
         {
-            byte[] pdata = new byte[Data.Length + 1];
+            byte[] pdata = new byte[Data.Length + _UnsequencedHeaderSize];
             pdata[0] = (byte)PacketType.Unsequenced;
+            _WriteInt(this._ConnectionID, pdata, 1);
             for (int t = 0; t < Data.Length; t++)
             {
-                pdata[t + 1] = Data[t];
+                pdata[t + _UnsequencedHeaderSize] = Data[t];
             }
             this._ResetKeepAlive();
             this.SendRaw(pdata);
@@ -649,12 +729,26 @@ public static class UDPX
             // Get packet type
             byte[] pdata;
             PacketType type = (PacketType)Data[0];
+
+            // Everything but the handshake carries our connection id straight after the type
+            if (type != PacketType.Handshake && type != PacketType.HandshakeAck)
+            {
+                if (Data.Length < _UnsequencedHeaderSize || _ReadInt(Data, 1) != this._ConnectionID)
+                {
+                    return;
+                }
+            }
+
             switch (type)
             {
                 case PacketType.Handshake:
-                    byte[] handshakeack = new byte[5];
+                    // Sent when the listener accepts, and again if our ack got lost. We never take early data.
+                    byte[] handshakeack = new byte[_HandshakeAckSize];
                     handshakeack[0] = (byte)PacketType.HandshakeAck;
                     _WriteInt(this._InitialSequence, handshakeack, 1);
+                    _WriteInt(this._ConnectionID, handshakeack, 5);
+                    _WriteInt(this._InitialReceiveSequence, handshakeack, 9);
+                    handshakeack[13] = 0;
                     this.SendRaw(handshakeack);
                     break;
 
@@ -662,10 +756,10 @@ public static class UDPX
                     break;
 
                 case PacketType.Unsequenced:
-                    pdata = new byte[Data.Length - 1];
+                    pdata = new byte[Data.Length - _UnsequencedHeaderSize];
                     for (int t = 0; t < pdata.Length; t++)
                     {
-                        pdata[t] = Data[t + 1];
+                        pdata[t] = Data[t + _UnsequencedHeaderSize];
                     }
                     if (this.ReceivedPacket != null)
                     {
@@ -687,8 +781,8 @@ public static class UDPX
                     }
 
                     // Decode sequence and receive numbers
-                    int sc = _ReadInt(Data, 1);
-                    int rc = _ReadInt(Data, 5);
+                    int sc = _ReadInt(Data, 5);
+                    int rc = _ReadInt(Data, 9);
                     if (this._ValidPacket(sc, rc))
                     {
                         this._ProcessReceiveNumber(rc);
@@ -764,8 +858,8 @@ public static class UDPX
                     }
 
                     // Decode sequence and receive numbers
-                    sc = _ReadInt(Data, 1); // Contains the last sent sequence number
-                    rc = _ReadInt(Data, 5);
+                    sc = _ReadInt(Data, 5); // Contains the last sent sequence number
+                    rc = _ReadInt(Data, 9);
 
                     if (this._ValidPacket(sc, rc))
                     {
@@ -783,12 +877,12 @@ public static class UDPX
                     break;
 
                 case PacketType.Request:
-                    if (Data.Length < 5)
+                    if (Data.Length < 1 + 4 + 4)
                     {
                         break;
                     }
 
-                    sc = _ReadInt(Data, 1);
+                    sc = _ReadInt(Data, 5);
 
                     // Send out requested packet
                     byte[] tosend;
@@ -805,8 +899,8 @@ public static class UDPX
                     }
 
                     // Decode sequence and receive numbers (to prove this is a valid disconnect).
-                    sc = _ReadInt(Data, 1);
-                    rc = _ReadInt(Data, 5);
+                    sc = _ReadInt(Data, 5);
+                    rc = _ReadInt(Data, 9);
 
                     if (this._ValidPacket(sc, rc))
                     {
@@ -884,6 +978,21 @@ public static class UDPX
         /// The first sequence number used for sending.
         /// </summary>
         private int _InitialSequence;
+
+        /// <summary>
+        /// The first sequence number the other end used for sending.
+        /// </summary>
+        private int _InitialReceiveSequence;
+
+        /// <summary>
+        /// The id the listener gave this connection.
+        /// </summary>
+        private int _ConnectionID;
+
+        /// <summary>
+        /// The number of keep alive packets sent.
+        /// </summary>
+        private int _KeepAliveCount;
     }
 
     private static void _WriteInt(int Int, byte[] Data, int Offset)
@@ -906,12 +1015,11 @@ public static class UDPX
     /// </summary>
     private class _ClientConnection : _Connection
     {
-        public _ClientConnection(int InitialSequence, int InitialReceiveSequence, UdpClient Client, IPEndPoint EndPoint)
-            : base(InitialSequence, InitialReceiveSequence)
+        public _ClientConnection(int ConnectionID, int InitialSequence, int InitialReceiveSequence, UdpClient Client, IPEndPoint EndPoint)
+            : base(ConnectionID, InitialSequence, InitialReceiveSequence)
         {
             this._Client = Client;
             this._EndPoint = EndPoint;
-            this._BeginListen();
         }
 
         public override void OnDispose()
@@ -932,7 +1040,10 @@ public static class UDPX
             }
         }
 
-        private void _BeginListen()
+        /// <summary>
+        /// Starts receiving for this connection, once its handlers are hooked up.
+        /// </summary>
+        internal void _BeginListen()
         {
             UDPX.Receive(this._Client, delegate(IPEndPoint From, byte[] Data)
             {
@@ -964,6 +1075,9 @@ public static class UDPX
         Handshake,
         HandshakeAck,
         KeepAlive,
-        Disconnect
+        Disconnect,
+        Ticket, // The rest are only sent by UDPXLib, and ignored here
+        FECData,
+        FECParity
     }
 }
\ No newline at end of file
@@ -0,0 +1,169 @@
+/*
+ *	Capture files for replaying traffic through the protocol engine, see Capture.h
+ */
+
+#include "Capture.h"
+#include <string.h>
+
+namespace UDPX
+{
+	CaptureWriter::CaptureWriter()
+	{
+		this->m_pFile = NULL;
+		this->m_Start = 0.0;
+		this->m_Dirty = false;
+	}
+	CaptureWriter::~CaptureWriter()
+	{
+		if(this->m_pFile)
+		{
+			this->Flush();
+			fclose(this->m_pFile);
+		}
+	}
+	bool CaptureWriter::Open(const char* Path, unsigned int MaxSize, double Now)
+	{
+		if(MaxSize <= sizeof(CaptureFileHeader))
+			return false;
+		this->m_pFile = fopen(Path, "w+b");
+		if(!this->m_pFile)
+			return false;
+		setvbuf(this->m_pFile, NULL, _IOFBF, 1 << 20); // Records go to disk in big lumps, not one write each
+
+		this->m_Header.Magic = UDPX_CAPTUREMAGIC;
+		this->m_Header.Version = UDPX_CAPTUREVERSION;
+		this->m_Header.Size = MaxSize;
+		this->m_Header.Oldest = sizeof(CaptureFileHeader);
+		this->m_Header.LapEnd = 0;
+		this->m_Header.End = sizeof(CaptureFileHeader);
+		this->m_Start = Now;
+		this->m_Dirty = true;
+		this->Flush();
+		return true;
+	}
+	void CaptureWriter::Write(double Now, CaptureDirection Direction, unsigned short LocalPort, UDPXAddress* Peer, unsigned int ConnectionID, const BYTE* Data, int Length)
+	{
+		if(!this->m_pFile)
+			return;
+		unsigned int size = sizeof(CaptureRecordHeader) + Length;
+		if(sizeof(CaptureFileHeader) + size > this->m_Header.Size)
+			return; // It'd never fit
+
+		unsigned int position = this->m_Header.End;
+		if(position + size > this->m_Header.Size)
+		{
+			// Back round to the start, everything so far is the previous lap now. Whatever's left of the lap before
+			// that lies past where this one ended, and there's only room in the header for two, so it goes.
+			this->m_Header.LapEnd = position;
+			position = sizeof(CaptureFileHeader);
+			fseek(this->m_pFile, position, SEEK_SET);
+			while(!this->m_Records.empty() && this->m_Records.front() >= this->m_Header.LapEnd)
+				this->m_Records.pop_front();
+		}
+
+		// The previous lap's records are all ahead of us and in order, so every one we're about to write over (any
+		// starting before we finish) is at the front
+		while(!this->m_Records.empty() && this->m_Records.front() >= position && this->m_Records.front() < position + size)
+			this->m_Records.pop_front();
+		if(this->m_Records.empty() || this->m_Records.front() < position)
+			this->m_Header.LapEnd = 0; // Nothing left of it
+
+		CaptureRecordHeader record;
+		record.Time = Now - this->m_Start;
+		Peer->GetIPv6(record.Address);
+		record.Port = Peer->Port;
+		record.LocalPort = LocalPort;
+		record.ConnectionID = ConnectionID;
+		record.Direction = Direction;
+		record.Length = Length;
+		fwrite(&record, sizeof(record), 1, this->m_pFile);
+		fwrite(Data, 1, Length, this->m_pFile);
+
+		this->m_Records.push_back(position);
+		this->m_Header.End = position + size;
+		this->m_Header.Oldest = this->m_Records.front();
+		this->m_Dirty = true;
+	}
+	void CaptureWriter::Flush()
+	{
+		if(!this->m_pFile || !this->m_Dirty)
+			return;
+		// The header's written last, so a reader never sees records that aren't on disk yet
+		fflush(this->m_pFile);
+		fseek(this->m_pFile, 0, SEEK_SET);
+		fwrite(&this->m_Header, sizeof(this->m_Header), 1, this->m_pFile);
+		fflush(this->m_pFile);
+		fseek(this->m_pFile, this->m_Header.End, SEEK_SET);
+		this->m_Dirty = false;
+	}
+
+	CaptureReader::CaptureReader()
+	{
+		this->m_pFile = NULL;
+		this->m_Position = 0;
+		this->m_Wrapped = false;
+	}
+	CaptureReader::~CaptureReader()
+	{
+		if(this->m_pFile)
+			fclose(this->m_pFile);
+	}
+	bool CaptureReader::Open(const char* Path)
+	{
+		this->m_pFile = fopen(Path, "rb");
+		if(!this->m_pFile)
+			return false;
+		if(fread(&this->m_Header, sizeof(this->m_Header), 1, this->m_pFile) != 1 || this->m_Header.Magic != UDPX_CAPTUREMAGIC || this->m_Header.Version != UDPX_CAPTUREVERSION)
+		{
+			fclose(this->m_pFile);
+			this->m_pFile = NULL;
+			return false;
+		}
+		this->Rewind();
+		return true;
+	}
+	void CaptureReader::Rewind()
+	{
+		this->m_Position = this->m_Header.Oldest;
+		this->m_Wrapped = this->m_Header.LapEnd == 0;
+		fseek(this->m_pFile, this->m_Position, SEEK_SET);
+	}
+	bool CaptureReader::Next(CaptureRecord* pRecord)
+	{
+		if(!this->m_pFile)
+			return false;
+		while(true)
+		{
+			unsigned int end = this->m_Wrapped ? this->m_Header.End : this->m_Header.LapEnd;
+			if(this->m_Position + sizeof(CaptureRecordHeader) > end)
+			{
+				if(this->m_Wrapped)
+					return false;
+				// Done with the previous lap, the newer records start back at the beginning
+				this->m_Wrapped = true;
+				this->m_Position = sizeof(CaptureFileHeader);
+				fseek(this->m_pFile, this->m_Position, SEEK_SET);
+				continue;
+			}
+
+			CaptureRecordHeader record;
+			if(fread(&record, sizeof(record), 1, this->m_pFile) != 1)
+				return false;
+			if(record.Length < 0 || this->m_Position + sizeof(record) + record.Length > end)
+				return false; // Torn, it was being written when the capture stopped
+			this->m_Data.resize(record.Length + 1);
+			if(record.Length > 0 && fread(&this->m_Data[0], 1, record.Length, this->m_pFile) != (size_t)record.Length)
+				return false;
+			this->m_Position += sizeof(record) + record.Length;
+
+			pRecord->Time = record.Time;
+			pRecord->Direction = (CaptureDirection)record.Direction;
+			pRecord->LocalPort = record.LocalPort;
+			pRecord->Peer = UDPXAddress::FromIPv6(record.Address, record.Port);
+			pRecord->ConnectionID = record.ConnectionID;
+			pRecord->Data = &this->m_Data[0];
+			pRecord->Length = record.Length;
+			return true;
+		}
+	}
+}
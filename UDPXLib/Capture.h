@@ -0,0 +1,94 @@
+#ifndef UDPX_CAPTURE_H
+#define UDPX_CAPTURE_H
+
+#include "UDPX.h"
+#include <stdio.h>
+#include <deque>
+#include <vector>
+
+using std::deque;
+using std::vector;
+
+#define UDPX_CAPTUREMAGIC (0x58504455) // "UDPX"
+#define UDPX_CAPTUREVERSION (2) // 2: 16 byte addresses
+
+namespace UDPX
+{
+	enum CaptureDirection : BYTE
+	{
+		CaptureIn,
+		CaptureOut
+	};
+
+	// Capture files are native byte order, they're read back on the machine (or at least the architecture) that wrote them
+#pragma pack(push, 1)
+	struct CaptureFileHeader
+	{
+		unsigned int Magic;
+		unsigned int Version;
+		unsigned int Size; // The file never grows past this, the oldest records are written over instead
+		unsigned int Oldest; // Offset of the oldest record
+		unsigned int LapEnd; // Where the records before the last wrap stop, 0 if there aren't any left
+		unsigned int End; // Where the newest record ends
+	};
+
+	struct CaptureRecordHeader
+	{
+		double Time; // Seconds since the capture started
+		BYTE Address[16]; // The other end, IPv4 as ::ffff:a.b.c.d
+		unsigned short Port;
+		unsigned short LocalPort; // Which of our sockets it went through
+		unsigned int ConnectionID; // 0 for a Handshake, there isn't one yet
+		BYTE Direction;
+		int Length; // The datagram follows
+	};
+#pragma pack(pop)
+
+	struct CaptureRecord
+	{
+		double Time;
+		CaptureDirection Direction;
+		unsigned short LocalPort;
+		UDPXAddress Peer;
+		unsigned int ConnectionID;
+		BYTE* Data; // Good until the next record's read
+		int Length;
+	};
+
+	// Appends datagrams to a ring file; everything's buffered, only Flush puts the header (and so the new records) on disk.
+	// Called under the I/O loop's lock.
+	class CaptureWriter
+	{
+	public:
+		CaptureWriter();
+		~CaptureWriter();
+		bool				Open(const char* Path, unsigned int MaxSize, double Now);
+		void				Write(double Now, CaptureDirection Direction, unsigned short LocalPort, UDPXAddress* Peer, unsigned int ConnectionID, const BYTE* Data, int Length);
+		void				Flush(void);
+	private:
+		FILE*				m_pFile;
+		CaptureFileHeader	m_Header;
+		deque<unsigned int>	m_Records; // Where every record still in the file starts, oldest first
+		double				m_Start;
+		bool				m_Dirty;
+	};
+
+	class CaptureReader
+	{
+	public:
+		CaptureReader();
+		~CaptureReader();
+		bool				Open(const char* Path);
+		// The next record in the order they were written, false when there are no more
+		bool				Next(CaptureRecord* pRecord);
+		void				Rewind(void);
+	private:
+		FILE*				m_pFile;
+		CaptureFileHeader	m_Header;
+		unsigned int		m_Position;
+		bool				m_Wrapped; // Past the previous lap's records, onto the newest
+		vector<BYTE>		m_Data;
+	};
+}
+
+#endif // UDPX_CAPTURE_H
@@ -0,0 +1,228 @@
+/*
+ *	Forward error correction for unchecked packets, see FEC.h
+ */
+
+#include "FEC.h"
+#include <string.h>
+
+#if defined(_M_IX86) || defined(_M_X64)
+#define UDPX_FEC_SSSE3
+#include <intrin.h>
+#include <tmmintrin.h>
+#endif
+
+namespace UDPX
+{
+	// Private
+	BYTE _GFExp[512]; // Doubled up so a sum of two logs never needs reducing
+	int _GFLog[256];
+
+	struct _GFTables
+	{
+		_GFTables()
+		{
+			int x = 1;
+			for(int i = 0; i < 255; i++)
+			{
+				_GFExp[i] = (BYTE)x;
+				_GFLog[x] = i;
+				x <<= 1;
+				if(x & 0x100)
+					x ^= 0x11d; // x^8 + x^4 + x^3 + x^2 + 1
+			}
+			for(int i = 255; i < 512; i++)
+				_GFExp[i] = _GFExp[i - 255];
+			_GFLog[0] = 0;
+		}
+	} _GFTablesInit;
+
+#ifdef UDPX_FEC_SSSE3
+	bool _HasSSSE3()
+	{
+		int info[4];
+		__cpuid(info, 1);
+		return (info[2] & (1 << 9)) != 0;
+	}
+	bool _UseSSSE3 = _HasSSSE3();
+#endif
+
+	// Public
+	BYTE GFMul(BYTE a, BYTE b)
+	{
+		if(a == 0 || b == 0)
+			return 0;
+		return _GFExp[_GFLog[a] + _GFLog[b]];
+	}
+
+	BYTE GFInv(BYTE a)
+	{
+		return _GFExp[255 - _GFLog[a]];
+	}
+
+	void GFMulAdd(BYTE* Dest, const BYTE* Source, BYTE Factor, int Size)
+	{
+		if(Factor == 0)
+			return;
+		int i = 0;
+
+#ifdef UDPX_FEC_SSSE3
+		if(Factor == 1)
+		{
+			for(; i + 16 <= Size; i += 16)
+			{
+				__m128i src = _mm_loadu_si128((const __m128i*)(Source + i));
+				__m128i dst = _mm_loadu_si128((const __m128i*)(Dest + i));
+				_mm_storeu_si128((__m128i*)(Dest + i), _mm_xor_si128(dst, src));
+			}
+		}
+		else if(_UseSSSE3)
+		{
+			// Multiplication distributes over xor, so Factor * x is Factor * (x & 0x0f) ^ Factor * (x & 0xf0); both
+			// halves are 16 entry tables, which is exactly what PSHUFB looks up.
+			BYTE low[16], high[16];
+			for(int n = 0; n < 16; n++)
+			{
+				low[n] = GFMul(Factor, (BYTE)n);
+				high[n] = GFMul(Factor, (BYTE)(n << 4));
+			}
+			__m128i lowtable = _mm_loadu_si128((const __m128i*)low);
+			__m128i hightable = _mm_loadu_si128((const __m128i*)high);
+			__m128i mask = _mm_set1_epi8(0x0f);
+			for(; i + 16 <= Size; i += 16)
+			{
+				__m128i src = _mm_loadu_si128((const __m128i*)(Source + i));
+				__m128i lo = _mm_shuffle_epi8(lowtable, _mm_and_si128(src, mask));
+				__m128i hi = _mm_shuffle_epi8(hightable, _mm_and_si128(_mm_srli_epi64(src, 4), mask));
+				__m128i dst = _mm_loadu_si128((const __m128i*)(Dest + i));
+				_mm_storeu_si128((__m128i*)(Dest + i), _mm_xor_si128(dst, _mm_xor_si128(lo, hi)));
+			}
+		}
+#endif
+
+		// Whatever's left (or everything, without SSSE3)
+		if(Factor == 1)
+		{
+			for(; i < Size; i++)
+				Dest[i] ^= Source[i];
+			return;
+		}
+		int logfactor = _GFLog[Factor];
+		for(; i < Size; i++)
+			if(Source[i])
+				Dest[i] ^= _GFExp[_GFLog[Source[i]] + logfactor];
+	}
+
+	FECCodec::FECCodec(int K, int M)
+	{
+		this->m_K = K;
+		this->m_M = M;
+		this->m_Matrix.resize(K * M);
+		for(int i = 0; i < M; i++)
+		{
+			for(int j = 0; j < K; j++)
+			{
+				if(M == 1)
+					this->m_Matrix[j] = 1; // Just xor
+				else
+					this->m_Matrix[i * K + j] = GFInv((BYTE)((K + i) ^ j)); // Cauchy, every square submatrix is invertible
+			}
+		}
+	}
+	int FECCodec::GetK()
+	{
+		return this->m_K;
+	}
+	int FECCodec::GetM()
+	{
+		return this->m_M;
+	}
+	void FECCodec::Encode(BYTE** Data, BYTE** Parity, int Size)
+	{
+		for(int i = 0; i < this->m_M; i++)
+		{
+			memset(Parity[i], 0, Size);
+			for(int j = 0; j < this->m_K; j++)
+				GFMulAdd(Parity[i], Data[j], this->m_Matrix[i * this->m_K + j], Size);
+		}
+	}
+	bool FECCodec::Decode(BYTE** Blocks, bool* Present, int Size)
+	{
+		int K = this->m_K;
+		int missing[UDPX_FECMAXBLOCKS];
+		int parity[UDPX_FECMAXBLOCKS];
+		int count = 0;
+		for(int j = 0; j < K; j++)
+			if(!Present[j])
+				missing[count++] = j;
+		if(count == 0)
+			return true;
+
+		int found = 0;
+		for(int i = 0; i < this->m_M && found < count; i++)
+			if(Present[K + i])
+				parity[found++] = i;
+		if(found < count)
+			return false;
+
+		// Take what we know away from each parity block we're using, leaving what's left in the missing blocks' buffers:
+		// S[r] = sum over missing c of Matrix[parity[r]][missing[c]] * D[missing[c]]
+		for(int r = 0; r < count; r++)
+		{
+			BYTE* syndrome = Blocks[missing[r]];
+			memcpy(syndrome, Blocks[K + parity[r]], Size);
+			for(int j = 0; j < K; j++)
+				if(Present[j])
+					GFMulAdd(syndrome, Blocks[j], this->m_Matrix[parity[r] * K + j], Size);
+		}
+
+		// Invert that count x count system with Gauss-Jordan
+		vector<BYTE> a(count * count);
+		vector<BYTE> inv(count * count, 0);
+		for(int r = 0; r < count; r++)
+		{
+			for(int c = 0; c < count; c++)
+				a[r * count + c] = this->m_Matrix[parity[r] * K + missing[c]];
+			inv[r * count + r] = 1;
+		}
+		for(int c = 0; c < count; c++)
+		{
+			int pivot = c;
+			while(a[pivot * count + c] == 0)
+				pivot++; // Can't run off the end, the submatrix is invertible
+			if(pivot != c)
+			{
+				for(int n = 0; n < count; n++)
+				{
+					BYTE t = a[c * count + n]; a[c * count + n] = a[pivot * count + n]; a[pivot * count + n] = t;
+					t = inv[c * count + n]; inv[c * count + n] = inv[pivot * count + n]; inv[pivot * count + n] = t;
+				}
+			}
+			BYTE scale = GFInv(a[c * count + c]);
+			for(int n = 0; n < count; n++)
+			{
+				a[c * count + n] = GFMul(a[c * count + n], scale);
+				inv[c * count + n] = GFMul(inv[c * count + n], scale);
+			}
+			for(int r = 0; r < count; r++)
+			{
+				BYTE factor = a[r * count + c];
+				if(r == c || factor == 0)
+					continue;
+				for(int n = 0; n < count; n++)
+				{
+					a[r * count + n] ^= GFMul(factor, a[c * count + n]);
+					inv[r * count + n] ^= GFMul(factor, inv[c * count + n]);
+				}
+			}
+		}
+
+		// D[missing] = inv * S, the syndromes live in the output buffers so build the answer on the side
+		vector<BYTE> result(count * Size, 0);
+		for(int c = 0; c < count; c++)
+			for(int r = 0; r < count; r++)
+				GFMulAdd(&result[c * Size], Blocks[missing[r]], inv[c * count + r], Size);
+		for(int c = 0; c < count; c++)
+			memcpy(Blocks[missing[c]], &result[c * Size], Size);
+		return true;
+	}
+}
@@ -0,0 +1,37 @@
+#ifndef UDPX_FEC_H
+#define UDPX_FEC_H
+
+#include "windows.h"
+#include <vector>
+
+using std::vector;
+
+#define UDPX_FECMAXBLOCKS (256) // K + M, GF(2^8) only has so many distinct points to build the code from
+
+namespace UDPX
+{
+	// Erasure code over GF(2^8) for groups of K equal sized data blocks and M parity blocks. With M = 1 it's plain XOR
+	// parity, otherwise it's a systematic Cauchy Reed-Solomon code, which can rebuild any M lost blocks.
+	class FECCodec
+	{
+	public:
+		FECCodec(int K, int M);
+		int					GetK(void);
+		int					GetM(void);
+		void				Encode(BYTE** Data, BYTE** Parity, int Size);
+		// Blocks holds K data followed by M parity pointers, Present says which of them arrived. Missing data blocks are
+		// written into their (caller allocated) buffers. Returns false if fewer than K blocks arrived.
+		bool				Decode(BYTE** Blocks, bool* Present, int Size);
+	private:
+		int					m_K;
+		int					m_M;
+		vector<BYTE>		m_Matrix; // M rows of K coefficients
+	};
+
+	BYTE GFMul(BYTE a, BYTE b);
+	BYTE GFInv(BYTE a);
+	// Dest ^= Factor * Source, the only thing encoding and decoding spend any real time doing
+	void GFMulAdd(BYTE* Dest, const BYTE* Source, BYTE Factor, int Size);
+}
+
+#endif // UDPX_FEC_H
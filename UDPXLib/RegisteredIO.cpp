@@ -0,0 +1,295 @@
+/*
+ *	Registered I/O backend for the I/O loop, see RegisteredIO.h
+ */
+
+#include "UDPX.h"
+#include "RegisteredIO.h"
+
+namespace UDPX
+{
+#ifdef UDPX_RIO
+	RegisteredIO::RegisteredIO()
+	{
+		this->m_pPool = NULL;
+		this->m_BusyPoll = false;
+		this->m_Event = NULL;
+		this->m_Queue = RIO_INVALID_CQ;
+		this->m_QueueSize = 0;
+		this->m_ResultCount = 0;
+		this->m_ResultNext = 0;
+	}
+	RegisteredIO* RegisteredIO::Create(PacketPool* pPool, bool BusyPoll)
+	{
+		// The function table can only be had from a socket made for registered I/O
+		SOCKET probe = WSASocket(AF_INET, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, WSA_FLAG_REGISTERED_IO);
+		if(probe == INVALID_SOCKET)
+			return NULL;
+
+		RegisteredIO* rio = new RegisteredIO();
+		GUID id = WSAID_MULTIPLE_RIO;
+		DWORD bytes = 0;
+		int result = WSAIoctl(probe, SIO_GET_MULTIPLE_EXTENSION_FUNCTION_POINTER, &id, sizeof(id), &rio->m_Functions, sizeof(rio->m_Functions), &bytes, NULL, NULL);
+		closesocket(probe);
+		if(result != 0)
+		{
+			delete rio;
+			return NULL;
+		}
+
+		rio->m_pPool = pPool;
+		rio->m_BusyPoll = BusyPoll;
+		rio->m_QueueSize = (UDPX_RIORECEIVES + 1) * 4;
+		if(BusyPoll)
+			rio->m_Queue = rio->m_Functions.RIOCreateCompletionQueue(rio->m_QueueSize, NULL);
+		else
+		{
+			rio->m_Event = CreateEvent(NULL, FALSE, FALSE, NULL);
+			RIO_NOTIFICATION_COMPLETION notify;
+			notify.Type = RIO_EVENT_COMPLETION;
+			notify.Event.EventHandle = rio->m_Event;
+			notify.Event.NotifyReset = TRUE;
+			rio->m_Queue = rio->m_Functions.RIOCreateCompletionQueue(rio->m_QueueSize, &notify);
+		}
+		if(rio->m_Queue == RIO_INVALID_CQ)
+		{
+			delete rio;
+			return NULL;
+		}
+		return rio;
+	}
+	RegisteredIO::~RegisteredIO()
+	{
+		if(this->m_Queue != RIO_INVALID_CQ)
+			this->m_Functions.RIOCloseCompletionQueue(this->m_Queue);
+		while(!this->m_Registrations.empty())
+			this->Destroy(this->m_Registrations.back());
+		for(size_t i = 0; i < this->m_Slabs.size(); i++)
+			this->m_Functions.RIODeregisterBuffer(this->m_Slabs[i]);
+		if(this->m_Event)
+			CloseHandle(this->m_Event);
+	}
+	bool RegisteredIO::AddSocket(Socket* pSocket, Listener* pListener)
+	{
+		// Every request we post can complete, so the queue needs room for all of them
+		DWORD needed = (DWORD)(this->m_Registrations.size() + 1) * (UDPX_RIORECEIVES + 1);
+		if(needed > this->m_QueueSize)
+		{
+			if(!this->m_Functions.RIOResizeCompletionQueue(this->m_Queue, needed * 2))
+				return false;
+			this->m_QueueSize = needed * 2;
+		}
+
+		RIORegistration* registration = new RIORegistration();
+		registration->pSocket = pSocket;
+		registration->pListener = pListener;
+		registration->Outstanding = 0;
+		registration->Closed = false;
+		registration->Uncommitted = false;
+		registration->Queue = this->m_Functions.RIOCreateRequestQueue(pSocket->GetHandle(), UDPX_RIORECEIVES, 1, 1, 1, this->m_Queue, this->m_Queue, registration);
+		registration->AddressBuffer = this->m_Functions.RIORegisterBuffer((PCHAR)registration->Addresses, sizeof(registration->Addresses));
+		if(registration->Queue == RIO_INVALID_RQ || registration->AddressBuffer == RIO_INVALID_BUFFERID)
+		{
+			if(registration->AddressBuffer != RIO_INVALID_BUFFERID)
+				this->m_Functions.RIODeregisterBuffer(registration->AddressBuffer);
+			delete registration; // The request queue goes with the socket
+			return false;
+		}
+		this->m_Registrations.push_back(registration);
+
+		for(int i = 0; i < UDPX_RIORECEIVES; i++)
+		{
+			registration->Receives[i].pOwner = registration;
+			registration->Receives[i].Index = i;
+			registration->Receives[i].pPacket = NULL;
+			this->Post(registration, i);
+		}
+		if(registration->Uncommitted)
+		{
+			this->m_Functions.RIOReceiveEx(registration->Queue, NULL, 0, NULL, NULL, NULL, NULL, RIO_MSG_COMMIT_ONLY, NULL);
+			registration->Uncommitted = false;
+		}
+		return true;
+	}
+	void RegisteredIO::RemoveSocket(Socket* pSocket)
+	{
+		for(size_t i = 0; i < this->m_Registrations.size(); i++)
+		{
+			RIORegistration* registration = this->m_Registrations[i];
+			if(registration->Closed || registration->pSocket != pSocket)
+				continue;
+			// Its receives come back failed once the socket's closed, until then the kernel still owns their buffers
+			registration->Closed = true;
+			registration->pSocket = NULL;
+			registration->pListener = NULL;
+			if(registration->Outstanding == 0)
+				this->Destroy(registration);
+			return;
+		}
+	}
+	void RegisteredIO::WakeOn(Socket* pSocket)
+	{
+		if(this->m_Event) // Busy polling comes back round regardless
+			WSAEventSelect(pSocket->GetHandle(), this->m_Event, FD_READ);
+	}
+	void RegisteredIO::Wake()
+	{
+		if(this->m_Event)
+			SetEvent(this->m_Event);
+	}
+	void RegisteredIO::Destroy(RIORegistration* pRegistration)
+	{
+		for(size_t i = 0; i < this->m_Registrations.size(); i++)
+		{
+			if(this->m_Registrations[i] == pRegistration)
+			{
+				this->m_Registrations.erase(this->m_Registrations.begin() + i);
+				break;
+			}
+		}
+		for(int i = 0; i < UDPX_RIORECEIVES; i++)
+			if(pRegistration->Receives[i].pPacket)
+				this->m_pPool->Free(pRegistration->Receives[i].pPacket);
+		this->m_Functions.RIODeregisterBuffer(pRegistration->AddressBuffer);
+		delete pRegistration;
+	}
+	bool RegisteredIO::GetBuffer(Packet* pPacket, RIO_BUF* pBuffer)
+	{
+		while((int)this->m_Slabs.size() <= pPacket->Slab)
+		{
+			int slab = (int)this->m_Slabs.size();
+			RIO_BUFFERID id = this->m_Functions.RIORegisterBuffer((PCHAR)this->m_pPool->GetSlab(slab), this->m_pPool->GetSlabSize());
+			if(id == RIO_INVALID_BUFFERID)
+				return false;
+			this->m_Slabs.push_back(id);
+		}
+		pBuffer->BufferId = this->m_Slabs[pPacket->Slab];
+		pBuffer->Offset = (ULONG)(pPacket->Data - this->m_pPool->GetSlab(pPacket->Slab));
+		pBuffer->Length = UDPX_MAXPACKETSIZE + UDPX_PACKETHEADERSIZE;
+		return true;
+	}
+	bool RegisteredIO::Post(RIORegistration* pRegistration, int Index)
+	{
+		RIOReceive* receive = &pRegistration->Receives[Index];
+		receive->pPacket = this->m_pPool->Alloc();
+
+		RIO_BUF data;
+		RIO_BUF address;
+		address.BufferId = pRegistration->AddressBuffer;
+		address.Offset = Index * sizeof(SOCKADDR_INET);
+		address.Length = sizeof(SOCKADDR_INET);
+		// Deferred, the kernel hears about a whole batch of them at once
+		if(!this->GetBuffer(receive->pPacket, &data) || !this->m_Functions.RIOReceiveEx(pRegistration->Queue, &data, 1, NULL, &address, NULL, NULL, RIO_MSG_DEFER, receive))
+		{
+			this->m_pPool->Free(receive->pPacket);
+			receive->pPacket = NULL;
+			return false;
+		}
+		pRegistration->Outstanding++;
+		pRegistration->Uncommitted = true;
+		return true;
+	}
+	bool RegisteredIO::Wait(double Timeout)
+	{
+		if(this->m_ResultNext < this->m_ResultCount)
+			return true; // Still got some to hand out
+		if(this->m_BusyPoll)
+		{
+			// Only the I/O thread takes completions, so this needs no lock. Next hands out what we take here first.
+			this->m_ResultNext = 0;
+			this->m_ResultCount = this->m_Functions.RIODequeueCompletion(this->m_Queue, this->m_Results, UDPX_RIORECEIVES);
+			if(this->m_ResultCount == RIO_CORRUPT_CQ)
+				this->m_ResultCount = 0;
+			if(this->m_ResultCount == 0)
+				YieldProcessor();
+			return this->m_ResultCount > 0;
+		}
+		this->m_Functions.RIONotify(this->m_Queue);
+		WaitForSingleObject(this->m_Event, (DWORD)(Timeout * 1000.0));
+		return true;
+	}
+	Packet* RegisteredIO::Next(Listener** Owner)
+	{
+		while(true)
+		{
+			if(this->m_ResultNext >= this->m_ResultCount)
+			{
+				// Tell the kernel about everything we reposted for the last batch before taking the next
+				for(size_t i = 0; i < this->m_Registrations.size(); i++)
+				{
+					RIORegistration* registration = this->m_Registrations[i];
+					if(registration->Uncommitted && !registration->Closed)
+						this->m_Functions.RIOReceiveEx(registration->Queue, NULL, 0, NULL, NULL, NULL, NULL, RIO_MSG_COMMIT_ONLY, NULL);
+					registration->Uncommitted = false;
+				}
+				this->m_ResultNext = 0;
+				this->m_ResultCount = this->m_Functions.RIODequeueCompletion(this->m_Queue, this->m_Results, UDPX_RIORECEIVES);
+				if(this->m_ResultCount == 0 || this->m_ResultCount == RIO_CORRUPT_CQ)
+				{
+					this->m_ResultCount = 0;
+					return NULL;
+				}
+			}
+
+			RIORESULT& result = this->m_Results[this->m_ResultNext++];
+			RIOReceive* receive = (RIOReceive*)(ULONG_PTR)result.RequestContext;
+			RIORegistration* registration = receive->pOwner;
+			Packet* packet = receive->pPacket;
+			receive->pPacket = NULL;
+			registration->Outstanding--;
+
+			if(registration->Closed)
+			{
+				this->m_pPool->Free(packet);
+				if(registration->Outstanding == 0)
+					this->Destroy(registration);
+				continue;
+			}
+			if(result.Status != 0 || result.BytesTransferred == 0)
+			{
+				this->m_pPool->Free(packet);
+				this->Post(registration, receive->Index);
+				continue;
+			}
+
+			// Read the sender before the slot is reposted over it
+			SOCKADDR_INET& from = registration->Addresses[receive->Index];
+			packet->Sender = UDPXAddress::FromSockaddr((const sockaddr*)&from);
+			packet->Length = (int)result.BytesTransferred;
+			this->Post(registration, receive->Index);
+
+			*Owner = registration->pListener;
+			return packet;
+		}
+	}
+#else
+	// Nothing to build it with, Create always says no and the loop uses select
+	RegisteredIO* RegisteredIO::Create(PacketPool* pPool, bool BusyPoll)
+	{
+		return NULL;
+	}
+	RegisteredIO::~RegisteredIO()
+	{
+	}
+	bool RegisteredIO::AddSocket(Socket* pSocket, Listener* pListener)
+	{
+		return false;
+	}
+	void RegisteredIO::RemoveSocket(Socket* pSocket)
+	{
+	}
+	void RegisteredIO::WakeOn(Socket* pSocket)
+	{
+	}
+	void RegisteredIO::Wake()
+	{
+	}
+	bool RegisteredIO::Wait(double Timeout)
+	{
+		return false;
+	}
+	Packet* RegisteredIO::Next(Listener** Owner)
+	{
+		return NULL;
+	}
+#endif
+}
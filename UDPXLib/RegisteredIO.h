@@ -0,0 +1,89 @@
+#ifndef UDPX_REGISTEREDIO_H
+#define UDPX_REGISTEREDIO_H
+
+#include "winsock2.h"
+#include "ws2tcpip.h" // SOCKADDR_INET
+#include "mswsock.h"
+#include "windows.h"
+#include <vector>
+
+using std::vector;
+
+#ifdef WSAID_MULTIPLE_RIO // Windows 8 SDK and up, older ones only get the select loop
+#define UDPX_RIO
+#endif
+
+#define UDPX_RIORECEIVES (64) // Receives kept posted on each socket
+
+namespace UDPX
+{
+	class Socket;
+	class Listener;
+	class PacketPool;
+	struct Packet;
+
+#ifdef UDPX_RIO
+	struct RIORegistration;
+
+	struct RIOReceive
+	{
+		RIORegistration* pOwner;
+		int Index;
+		Packet* pPacket;
+	};
+
+	struct RIORegistration
+	{
+		Socket* pSocket;
+		Listener* pListener; // NULL for the client socket
+		RIO_RQ Queue;
+		RIO_BUFFERID AddressBuffer;
+		SOCKADDR_INET Addresses[UDPX_RIORECEIVES]; // Where each receive's sender is written
+		RIOReceive Receives[UDPX_RIORECEIVES];
+		int Outstanding;
+		bool Closed; // Its socket's gone, we're waiting for the kernel to give back its receives
+		bool Uncommitted; // Has deferred receives the kernel hasn't been told about
+	};
+#endif
+
+	// Registered I/O: receives are posted ahead of time into packet pool buffers that were registered with the kernel
+	// once, and come back through one completion queue, so a packet costs no syscall, copy or buffer lock of its own.
+	class RegisteredIO
+	{
+	public:
+		// NULL if the system doesn't have it. With BusyPoll the loop spins on the completion queue instead of sleeping.
+		static RegisteredIO* Create(PacketPool* pPool, bool BusyPoll);
+		~RegisteredIO();
+		bool				AddSocket(Socket* pSocket, Listener* pListener);
+		void				RemoveSocket(Socket* pSocket);
+		// For a socket AddSocket refused: Wait returns when it's readable too, so the caller can drain it itself
+		void				WakeOn(Socket* pSocket);
+		// Ends a Wait early, from any thread
+		void				Wake(void);
+		// Sleeps until something arrives or Timeout seconds pass, called without the loop's lock. Busy polling it only
+		// looks, and says whether anything's arrived, so the caller can skip the lock when nothing has.
+		bool				Wait(double Timeout);
+		// The next packet that's arrived, or NULL. The receive it came in on has already been reposted.
+		Packet*				Next(Listener** Owner);
+#ifdef UDPX_RIO
+	private:
+		RegisteredIO();
+		bool				Post(RIORegistration* pRegistration, int Index);
+		bool				GetBuffer(Packet* pPacket, RIO_BUF* pBuffer);
+		void				Destroy(RIORegistration* pRegistration);
+		RIO_EXTENSION_FUNCTION_TABLE m_Functions;
+		PacketPool*			m_pPool;
+		bool				m_BusyPoll;
+		HANDLE				m_Event;
+		RIO_CQ				m_Queue;
+		DWORD				m_QueueSize;
+		vector<RIO_BUFFERID> m_Slabs; // By pool slab, registered the first time a receive lands in one
+		vector<RIORegistration*> m_Registrations; // Including closed ones still waiting on the kernel
+		RIORESULT			m_Results[UDPX_RIORECEIVES];
+		ULONG				m_ResultCount;
+		ULONG				m_ResultNext;
+#endif
+	};
+}
+
+#endif // UDPX_REGISTEREDIO_H
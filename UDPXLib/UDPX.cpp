@@ -9,9 +9,15 @@
 
 #define WSAErr() do{cerr << "WSAError: " << WSAGetLastError() << endl;}while(false)
 #define PORT 27015
+#define _CRT_RAND_S // rand_s, for keys the other end shouldn't be able to guess
 
+#include <stdlib.h>
 #include <winsock2.h>
 #include "UDPX.h"
+#include "RegisteredIO.h"
+#include "Capture.h"
+#include "ws2tcpip.h"
+#include "mswsock.h"
 #include <iostream>
 #include <map>
 #include <time.h>
@@ -22,9 +28,17 @@ using std::cout;
 using std::cerr;
 using std::cin;
 using std::endl;
+using std::make_pair;
 using std::map;
 using namespace UDPX;
 
+#ifdef UDP_SEND_MSG_SIZE // Windows 10 SDK and up
+#define UDPX_USO
+#endif
+#ifdef UDP_RECV_MAX_COALESCED_SIZE
+#define UDPX_URO
+#endif
+
 namespace UDPX
 {
 	// Private
@@ -42,15 +56,240 @@ namespace UDPX
 		int Int = (int)Data[Offset + 0] + ((int)Data[Offset + 1] << 8) + ((int)Data[Offset + 2] << 16) + ((int)Data[Offset + 3] << 24);
 		return ntohl(Int);
 	}
+
+	int _PriorityWeight[UDPX_PRIORITYCOUNT] = {0, 8, 4, 1}; // Control doesn't take turns, it goes whenever it's there
+
+	// How many of the packets at the front of Queue can go out as one segmented send: all the same size, bar a shorter
+	// last, and no more than Limit bytes unless it's just the one
+	int _RunLength(SendQueueType& Queue, double Limit)
+	{
+		int size = Queue[0].Length;
+		int total = size;
+		int count = 1;
+		while(count < (int)Queue.size() && count < UDPX_MAXSEGMENTS)
+		{
+			int length = Queue[count].Length;
+			if(length > size || total + length > UDPX_MAXSEGMENTBYTES || total + length > Limit)
+				break;
+			total += length;
+			count++;
+			if(length < size)
+				break;
+		}
+		return count;
+	}
+
+#ifdef UDPX_URO
+	LPFN_WSARECVMSG _WSARecvMsg = NULL;
+
+	bool _GetWSARecvMsg(SOCKET Handle)
+	{
+		if(_WSARecvMsg)
+			return true;
+		GUID id = WSAID_WSARECVMSG;
+		DWORD bytes = 0;
+		return WSAIoctl(Handle, SIO_GET_EXTENSION_FUNCTION_POINTER, &id, sizeof(id), &_WSARecvMsg, sizeof(_WSARecvMsg), &bytes, NULL, NULL) == 0;
+	}
+#endif
+
+	unsigned int _PacketConnectionID(const BYTE* Data, int Length)
+	{
+		if(Length < UDPX_UNSEQUENCEDHEADERSIZE || Data[0] == PacketType::Handshake)
+			return 0;
+		if(Data[0] == PacketType::HandshakeAck)
+			return Length >= UDPX_HANDSHAKEACKSIZE ? (unsigned int)_ReadInt((BYTE*)Data, 5) : 0;
+		return (unsigned int)_ReadInt((BYTE*)Data, 1);
+	}
+
+	// Dual stack where the system can do it, so the one socket reaches hosts of either kind
+	SOCKET _CreateSocket(DWORD Flags, int* pFamily)
+	{
+		SOCKET handle = WSASocket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, Flags);
+		if(handle != INVALID_SOCKET)
+		{
+			DWORD v6only = 0;
+			if(setsockopt(handle, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&v6only, sizeof(v6only)) == 0)
+			{
+				*pFamily = AF_INET6;
+				return handle;
+			}
+			closesocket(handle); // XP's IPv6 sockets are IPv6 only
+		}
+		*pFamily = AF_INET;
+		return WSASocket(AF_INET, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, Flags);
+	}
+
+	// Only ever reachable from this machine, and not a UDPX socket, so nothing it sends is captured
+	SOCKET _CreateWakeSocket(sockaddr_in* pAddress)
+	{
+		SOCKET handle = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if(handle == INVALID_SOCKET)
+			return handle;
+		memset(pAddress, 0, sizeof(sockaddr_in));
+		pAddress->sin_family = AF_INET;
+		pAddress->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		int length = sizeof(sockaddr_in);
+		DWORD nonblocking = 1;
+		if(bind(handle, (const sockaddr*)pAddress, length) == SOCKET_ERROR || getsockname(handle, (sockaddr*)pAddress, &length) == SOCKET_ERROR ||
+			ioctlsocket(handle, FIONBIO, &nonblocking) != 0)
+		{
+			WSAErr();
+			closesocket(handle);
+			return INVALID_SOCKET;
+		}
+		return handle;
+	}
+
+	// The function pointer handelers, called through the new ones
+	struct _ConnectionFn
+	{
+		ConnectionHandelerFn Fn;
+		void operator()(const ConnectionHandle& Connection) const
+		{
+			this->Fn(Connection.get());
+		}
+	};
+	struct _DisconnectedFn
+	{
+		DisconnectedFn Fn;
+		void operator()(const ConnectionHandle& Connection, bool Explict) const
+		{
+			this->Fn(Connection.get(), Explict);
+		}
+	};
+	struct _ReceivedPacketFn
+	{
+		ReceivedPacketFn Fn;
+		void operator()(const ConnectionHandle& Connection, bool Checked, const PacketView& Data) const
+		{
+			this->Fn(Connection.get(), Checked, Data.GetData(), Data.GetLength());
+		}
+	};
+
+	ConnectionHandeler _Wrap(ConnectionHandelerFn Fn)
+	{
+		if(!Fn)
+			return ConnectionHandeler();
+		_ConnectionFn wrapped = {Fn};
+		return wrapped;
+	}
+	DisconnectedHandeler _Wrap(DisconnectedFn Fn)
+	{
+		if(!Fn)
+			return DisconnectedHandeler();
+		_DisconnectedFn wrapped = {Fn};
+		return wrapped;
+	}
+	ReceivedPacketHandeler _Wrap(ReceivedPacketFn Fn)
+	{
+		if(!Fn)
+			return ReceivedPacketHandeler();
+		_ReceivedPacketFn wrapped = {Fn};
+		return wrapped;
+	}
+
+	int _CreateInitialSequence()
+	{
+		// rand() is seeded per thread and the I/O thread never is, so every process would start from the same sequences
+		unsigned int r;
+		rand_s(&r);
+		return INT_MIN + (int)(r & 0x3FFFFFFF);
+	}
+
+	void _RandomBytes(BYTE* Data, int Length)
+	{
+		for(int i = 0; i < Length; i += 4)
+		{
+			unsigned int r;
+			rand_s(&r);
+			for(int n = 0; n < 4 && i + n < Length; n++)
+				Data[i + n] = (BYTE)(r >> (8 * n));
+		}
+	}
+
+	#define _SIPROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+	#define _SIPROUND() do{ \
+		v0 += v1; v1 = _SIPROTL(v1, 13); v1 ^= v0; v0 = _SIPROTL(v0, 32); \
+		v2 += v3; v3 = _SIPROTL(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = _SIPROTL(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = _SIPROTL(v1, 17); v1 ^= v2; v2 = _SIPROTL(v2, 32); }while(false)
+
+	unsigned long long _ReadULongLE(const BYTE* Data)
+	{
+		unsigned long long val = 0;
+		for(int i = 7; i >= 0; i--)
+			val = (val << 8) | Data[i];
+		return val;
+	}
+
+	// SipHash-2-4, used to sign resumption tickets
+	unsigned long long _SipHash(const BYTE* Key, const BYTE* Data, int Length)
+	{
+		unsigned long long k0 = _ReadULongLE(Key);
+		unsigned long long k1 = _ReadULongLE(Key + 8);
+		unsigned long long v0 = 0x736f6d6570736575ULL ^ k0;
+		unsigned long long v1 = 0x646f72616e646f6dULL ^ k1;
+		unsigned long long v2 = 0x6c7967656e657261ULL ^ k0;
+		unsigned long long v3 = 0x7465646279746573ULL ^ k1;
+
+		int end = Length - (Length % 8);
+		for(int i = 0; i < end; i += 8)
+		{
+			unsigned long long m = _ReadULongLE(Data + i);
+			v3 ^= m;
+			_SIPROUND();
+			_SIPROUND();
+			v0 ^= m;
+		}
+		unsigned long long b = ((unsigned long long)Length) << 56;
+		for(int i = 0; i < Length % 8; i++)
+			b |= (unsigned long long)Data[end + i] << (8 * i);
+		v3 ^= b;
+		_SIPROUND();
+		_SIPROUND();
+		v0 ^= b;
+		v2 ^= 0xff;
+		_SIPROUND();
+		_SIPROUND();
+		_SIPROUND();
+		_SIPROUND();
+		return v0 ^ v1 ^ v2 ^ v3;
+	}
+
+	CaptureWriter* g_pCapture = NULL;
+	bool g_Replaying = false;
+	double g_ReplayTime = 0.0; // The clock when replaying, it follows the capture
+
+	double _GetTime()
+	{
+		if(g_Replaying)
+			return g_ReplayTime;
+		LARGE_INTEGER frequency, counter;
+		QueryPerformanceFrequency(&frequency);
+		QueryPerformanceCounter(&counter);
+		return (double)counter.QuadPart / (double)frequency.QuadPart;
+	}
 	
 	// Public
+	IOLoop* g_pIOLoop = NULL;
+
 	bool InitSockets()
+	{
+		return InitSockets(BackendSelect, false);
+	}
+	bool InitSockets(IOBackend Backend, bool BusyPoll)
 	{
 		WSADATA WsaData;
-		return WSAStartup(MAKEWORD(2,2), &WsaData) == NO_ERROR;	 
+		if(WSAStartup(MAKEWORD(2,2), &WsaData) != NO_ERROR)
+			return false;
+		if(!g_pIOLoop)
+			g_pIOLoop = new IOLoop(Backend, BusyPoll);
+		return true;
 	}	 
 	void UninitSockets()
 	{
+		delete g_pIOLoop;
+		g_pIOLoop = NULL;
 		WSACleanup();
 	}
 
@@ -58,45 +297,200 @@ namespace UDPX
 	UDPXAddress::UDPXAddress()
 	{
 		Address = 0;
+		memset(Address6, 0, sizeof(Address6));
 		Port = 0;
+		IPv6 = false;
 	}
 	UDPXAddress::UDPXAddress( unsigned char a, unsigned char b, unsigned char c, unsigned char d, unsigned short Port )
 	{
-		Address = (a << 24) | (b << 16) | (c << 8) | d; // this is not network byte order
-		Port = Port;
+		this->Address = (a << 24) | (b << 16) | (c << 8) | d; // this is not network byte order
+		memset(this->Address6, 0, sizeof(this->Address6));
+		this->Port = Port;
+		this->IPv6 = false;
 	}
 	UDPXAddress::UDPXAddress( unsigned int Address, unsigned short Port )
 	{
-		Address = Address;
-		Port = Port;
+		this->Address = Address;
+		memset(this->Address6, 0, sizeof(this->Address6));
+		this->Port = Port;
+		this->IPv6 = false;
+	}
+	UDPXAddress UDPXAddress::FromIPv6(const BYTE* Address, unsigned short Port)
+	{
+		static const BYTE mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+		if(memcmp(Address, mapped, sizeof(mapped)) == 0)
+			return UDPXAddress(Address[12], Address[13], Address[14], Address[15], Port); // How a dual stack socket sees IPv4
+		UDPXAddress address;
+		memcpy(address.Address6, Address, sizeof(address.Address6));
+		address.Port = Port;
+		address.IPv6 = true;
+		return address;
+	}
+	UDPXAddress UDPXAddress::FromSockaddr(const sockaddr* pAddress)
+	{
+		if(pAddress->sa_family == AF_INET6)
+		{
+			const sockaddr_in6* address = (const sockaddr_in6*)pAddress;
+			return FromIPv6((const BYTE*)&address->sin6_addr, ntohs(address->sin6_port));
+		}
+		const sockaddr_in* address = (const sockaddr_in*)pAddress;
+		return UDPXAddress((unsigned int)ntohl(address->sin_addr.s_addr), ntohs(address->sin_port));
+	}
+	bool UDPXAddress::Parse(const char* Text, unsigned short Port, UDPXAddress* pAddress)
+	{
+		char text[64]; // WSAStringToAddress wants it writable
+		if(strlen(Text) >= sizeof(text))
+			return false;
+		strcpy(text, Text);
+
+		sockaddr_storage address;
+		int length = sizeof(address);
+		if(WSAStringToAddressA(text, AF_INET6, NULL, (sockaddr*)&address, &length) != 0)
+		{
+			length = sizeof(address);
+			if(WSAStringToAddressA(text, AF_INET, NULL, (sockaddr*)&address, &length) != 0)
+				return false;
+		}
+		*pAddress = FromSockaddr((const sockaddr*)&address);
+		pAddress->Port = Port;
+		return true;
+	}
+	bool UDPXAddress::IsIPv6() const
+	{
+		return this->IPv6;
+	}
+	void UDPXAddress::GetIPv6(BYTE* Address) const
+	{
+		if(this->IPv6)
+		{
+			memcpy(Address, this->Address6, sizeof(this->Address6));
+			return;
+		}
+		memset(Address, 0, 10);
+		Address[10] = Address[11] = 0xff;
+		Address[12] = (BYTE)(this->Address >> 24);
+		Address[13] = (BYTE)(this->Address >> 16);
+		Address[14] = (BYTE)(this->Address >> 8);
+		Address[15] = (BYTE)this->Address;
+	}
+	int UDPXAddress::ToSockaddr(sockaddr_storage* pAddress, int Family) const
+	{
+		memset(pAddress, 0, sizeof(sockaddr_storage));
+		if(Family == AF_INET6)
+		{
+			sockaddr_in6* address = (sockaddr_in6*)pAddress;
+			address->sin6_family = AF_INET6;
+			address->sin6_port = htons(this->Port);
+			this->GetIPv6((BYTE*)&address->sin6_addr);
+			return sizeof(sockaddr_in6);
+		}
+		if(this->IPv6)
+			return 0;
+		sockaddr_in* address = (sockaddr_in*)pAddress;
+		address->sin_family = AF_INET;
+		address->sin_addr.s_addr = htonl(this->Address);
+		address->sin_port = htons(this->Port);
+		return sizeof(sockaddr_in);
+	}
+	bool UDPXAddress::operator==(const UDPXAddress& Other) const
+	{
+		return this->Address == Other.Address && this->Port == Other.Port && this->IPv6 == Other.IPv6 && (!this->IPv6 || memcmp(this->Address6, Other.Address6, sizeof(this->Address6)) == 0);
+	}
+	bool UDPXAddress::operator!=(const UDPXAddress& Other) const
+	{
+		return !(*this == Other);
+	}
+	bool UDPXAddress::operator<(const UDPXAddress& Other) const
+	{
+		if(this->IPv6 != Other.IPv6)
+			return Other.IPv6;
+		if(this->Address != Other.Address)
+			return this->Address < Other.Address;
+		if(this->IPv6)
+		{
+			int order = memcmp(this->Address6, Other.Address6, sizeof(this->Address6));
+			if(order != 0)
+				return order < 0;
+		}
+		return this->Port < Other.Port;
 	}
 
 	Socket::Socket()
 	{
-		this->handle = socket( AF_INET, SOCK_DGRAM, IPPROTO_UDP );
+		this->handle = _CreateSocket(WSA_FLAG_OVERLAPPED, &this->family); // Just as socket() makes them
 		if (this->handle == INVALID_SOCKET)
 			WSAErr();
+		this->segment_send = false;
+		this->coalesce_receive = false;
+		this->port = 0;
 	}
 
-	bool Socket::Open(unsigned short port)
+	bool Socket::Open(unsigned short port, bool Registered)
 	{
+#ifdef UDPX_RIO
+		if(Registered)
+		{
+			// Registered I/O only works on sockets made for it
+			closesocket(this->handle);
+			this->handle = _CreateSocket(WSA_FLAG_REGISTERED_IO, &this->family);
+			if (this->handle == INVALID_SOCKET)
+				WSAErr();
+		}
+#endif
 		//set our ports etc
-		sockaddr_in address;
-		address.sin_family = AF_INET;
-		address.sin_addr.s_addr = INADDR_ANY;
-		address.sin_port = htons(port);
-		int result = bind(this->handle,(const sockaddr*) &address,sizeof(sockaddr_in));
+		sockaddr_storage address;
+		memset(&address, 0, sizeof(address)); // Any address, of either kind
+		address.ss_family = this->family;
+		int length = sizeof(sockaddr_in);
+		if(this->family == AF_INET6)
+		{
+			((sockaddr_in6*)&address)->sin6_port = htons(port);
+			length = sizeof(sockaddr_in6);
+		}
+		else
+			((sockaddr_in*)&address)->sin_port = htons(port);
+		int result = bind(this->handle,(const sockaddr*) &address,length);
 		if(result == SOCKET_ERROR)//incase another value below zero gets reserved to mean something other than 'rror'
 			WSAErr();
 
+		// Port 0 got whatever was free, find out what that was
+		length = sizeof(address);
+		if(getsockname(this->handle, (sockaddr*)&address, &length) == 0)
+			this->port = UDPXAddress::FromSockaddr((const sockaddr*)&address).Port;
+
 		DWORD nonblocking = 1;
 		if (ioctlsocket( this->handle,FIONBIO,&nonblocking) !=0)
 		{
 			cout<<"SOCKET FAILED TO SET NON-BLOCKING\n";
 			WSAErr();
 		}
+
+#ifdef UDPX_USO
+		// The stack can segment for us if it'll tell us its current segment size
+		DWORD segment = 0;
+		length = sizeof(segment);
+		this->segment_send = getsockopt(this->handle, IPPROTO_UDP, UDP_SEND_MSG_SIZE, (char*)&segment, &length) == 0;
+#endif
+#ifdef UDPX_URO
+		// Registered I/O receives don't say how things were coalesced, so only plain sockets can have it
+		if(!Registered && _GetWSARecvMsg(this->handle))
+		{
+			DWORD coalesced = UDPX_MAXSEGMENTBYTES;
+			this->coalesce_receive = setsockopt(this->handle, IPPROTO_UDP, UDP_RECV_MAX_COALESCED_SIZE, (const char*)&coalesced, sizeof(coalesced)) == 0;
+		}
+#endif
 		return 0;
 	}
+	void Socket::Detach(unsigned short port)
+	{
+		closesocket(this->handle);
+		this->handle = INVALID_SOCKET;
+		this->port = port;
+	}
+	unsigned short Socket::GetPort()
+	{
+		return this->port;
+	}
 	void Socket::Close()
 	{
 	  closesocket(this->handle);
@@ -104,31 +498,133 @@ namespace UDPX
 
 	bool Socket::Send(UDPXAddress* destination, const char* data, int size)
 	{
-		unsigned int dest_addr = destination->Address;
-		unsigned short dest_port = destination->Port;
+		if(this->handle == INVALID_SOCKET)
+			return true; // Detached, there's nowhere for it to go
 
-		sockaddr_in address;
-		address.sin_family = AF_INET;
-		address.sin_addr.s_addr = htonl(dest_addr);
-		address.sin_port = htons(dest_port);
+		sockaddr_storage address;
+		int length = destination->ToSockaddr(&address, this->family);
+		if(length == 0)
+		{
+			WSASetLastError(WSAEAFNOSUPPORT); // An IPv6 host, and we've only IPv4
+			return false;
+		}
 
-		int sent_bytes = sendto( this->handle, data, size, 0, (sockaddr*)&address, sizeof(address) );
+		int sent_bytes = sendto( this->handle, data, size, 0, (sockaddr*)&address, length );
 		if ( sent_bytes < size || this->handle == INVALID_SOCKET)//why would the socket explode after?
 		{
-			WSAErr();
+			if(WSAGetLastError() != WSAEWOULDBLOCK) // Just full, the scheduler will try again
+				WSAErr();
+			return false;
+		}
+
+		if(g_pCapture)
+			g_pCapture->Write(_GetTime(), CaptureOut, this->port, destination, _PacketConnectionID((const BYTE*)data, size), (const BYTE*)data, size);
+		return true;
+	}
+
+	bool Socket::SendSegmented(UDPXAddress* destination, const char* data, int size, int segment)
+	{
+#ifdef UDPX_USO
+		sockaddr_storage address;
+		int length = destination->ToSockaddr(&address, this->family);
+		if(length == 0)
+		{
+			WSASetLastError(WSAEAFNOSUPPORT);
 			return false;
 		}
 
+		WSABUF buffer;
+		buffer.buf = (CHAR*)data;
+		buffer.len = size;
+		char control[WSA_CMSG_SPACE(sizeof(DWORD))];
+		memset(control, 0, sizeof(control));
+
+		WSAMSG message;
+		message.name = (LPSOCKADDR)&address;
+		message.namelen = length;
+		message.lpBuffers = &buffer;
+		message.dwBufferCount = 1;
+		message.Control.buf = control;
+		message.Control.len = sizeof(control);
+		message.dwFlags = 0;
+
+		WSACMSGHDR* header = WSA_CMSG_FIRSTHDR(&message);
+		header->cmsg_level = IPPROTO_UDP;
+		header->cmsg_type = UDP_SEND_MSG_SIZE;
+		header->cmsg_len = WSA_CMSG_LEN(sizeof(DWORD));
+		*(DWORD*)WSA_CMSG_DATA(header) = segment;
+
+		DWORD sent_bytes = 0;
+		if(WSASendMsg(this->handle, &message, 0, &sent_bytes, NULL, NULL) == SOCKET_ERROR || (int)sent_bytes < size)
+		{
+			if(WSAGetLastError() != WSAEWOULDBLOCK)
+				WSAErr();
+			return false;
+		}
+		if(g_pCapture)
+		{
+			double now = _GetTime();
+			for(int offset = 0; offset < size; offset += segment) // As the other end will see them
+			{
+				int length = size - offset < segment ? size - offset : segment;
+				g_pCapture->Write(now, CaptureOut, this->port, destination, _PacketConnectionID((const BYTE*)data + offset, length), (const BYTE*)data + offset, length);
+			}
+		}
 		return true;
+#else
+		return false;
+#endif
+	}
+
+	bool Socket::CanSegment()
+	{
+		return this->segment_send;
+	}
+	void Socket::StopSegmenting()
+	{
+		this->segment_send = false;
 	}
 
-	int Socket::Receive(UDPXAddress* sender, void* data, int size)
+	int Socket::Receive(UDPXAddress* sender, void* data, int size, int* segment)
 	{
 		typedef int socklen_t;
-		socklen_t fromLength = sizeof(sockaddr_in);
-		sockaddr_in pAddr;
+		socklen_t fromLength = sizeof(sockaddr_storage);
+		sockaddr_storage pAddr;
+
+		int received_bytes;
+		if(segment)
+			*segment = 0;
+#ifdef UDPX_URO
+		if(this->coalesce_receive && segment)
+		{
+			// Same as recvfrom, but we need the control data to know how to split it up again
+			WSABUF buffer;
+			buffer.buf = (CHAR*)data;
+			buffer.len = size;
+			char control[WSA_CMSG_SPACE(sizeof(DWORD))];
 
-		int received_bytes = recvfrom(this->handle, (char*)data, size, 0,  (sockaddr*)&pAddr, &fromLength);//this passed sender for the sockaddr...(the dangers of c-casts arise!)
+			WSAMSG message;
+			message.name = (LPSOCKADDR)&pAddr;
+			message.namelen = fromLength;
+			message.lpBuffers = &buffer;
+			message.dwBufferCount = 1;
+			message.Control.buf = control;
+			message.Control.len = sizeof(control);
+			message.dwFlags = 0;
+
+			DWORD received = 0;
+			received_bytes = SOCKET_ERROR;
+			if(_WSARecvMsg(this->handle, &message, &received, NULL, NULL) != SOCKET_ERROR)
+			{
+				received_bytes = (int)received;
+				for(WSACMSGHDR* header = WSA_CMSG_FIRSTHDR(&message); header; header = WSA_CMSG_NXTHDR(&message, header))
+					if(header->cmsg_level == IPPROTO_UDP && header->cmsg_type == UDP_COALESCED_INFO)
+						*segment = (int)*(DWORD*)WSA_CMSG_DATA(header);
+			}
+		}
+		else
+#endif
+		received_bytes = recvfrom(this->handle, (char*)data, size, 0,  (sockaddr*)&pAddr, &fromLength);//this passed sender for the sockaddr...(the dangers of c-casts arise!)
 		
 		if(received_bytes == SOCKET_ERROR)
 		{
@@ -136,169 +632,642 @@ namespace UDPX
 				WSAErr();
 			return -1;
 		}
-		//pAddr.sin_addr.s_addr 
-		unsigned int test = (pAddr.sin_addr.S_un.S_un_b.s_b1 << 24) | (pAddr.sin_addr.S_un.S_un_b.s_b2 << 16) | (pAddr.sin_addr.S_un.S_un_b.s_b3 << 8) | pAddr.sin_addr.S_un.S_un_b.s_b4;
-
-		sender->Address = test; // because fuck you
-		sender->Port = pAddr.sin_port;
-		
+		*sender = UDPXAddress::FromSockaddr((const sockaddr*)&pAddr);
 		return received_bytes;
 	}
+
+	SOCKET Socket::GetHandle()
+	{
+		return this->handle;
+	}
 	
-	DWORD WINAPI IncomingPacketThread(void* arg)
+	void UDPXConnection::Think(double Elapsed)
 	{
-		UDPXConnection* _this = (UDPXConnection*)arg;
-		int Recived;
-		while(true)
+		if(this->m_SendRate > 0.0)
 		{
-			UDPXAddress* Sender = new UDPXAddress();
-			BYTE* Data = new BYTE[UDPX_MAXPACKETSIZE + UDPX_PACKETHEADERSIZE];
-			Recived = _this->m_Socket.Receive(Sender, Data, UDPX_MAXPACKETSIZE + UDPX_PACKETHEADERSIZE);
-			if(Recived > 0)
-				_this->ReciveRaw(Data, Recived);
-			if(_this->m_KeepAlive > 0.0)
-			{
-				_this->m_LastKeepAlive += 0.01;
-				if(_this->m_LastKeepAlive > _this->m_KeepAlive) // Looks like we need to send another keep alive
-					_this->SendKeepAlive();
-			}
-			if(_this->m_Timeout > 0.0)
+			this->m_SendTokens += this->m_SendRate * Elapsed;
+			if(this->m_SendTokens > this->m_SendRate * UDPX_BURSTTIME)
+				this->m_SendTokens = this->m_SendRate * UDPX_BURSTTIME;
+			if(this->m_Scheduled)
+				this->m_pScheduler->Activate(this); // Its backlog may be able to go again
+		}
+		if(!this->m_FECPending.empty())
+		{
+			this->m_FECAge += Elapsed;
+			if(this->m_FECAge > UDPX_FECFLUSHTIME) // Don't leave the tail of a burst unprotected
+				this->SendFECParity();
+		}
+		if(this->m_Disconnecting)
+			return; // Only here until what's queued has gone
+		if(this->m_KeepAlive > 0.0)
+		{
+			this->m_LastKeepAlive += Elapsed;
+			if(this->m_LastKeepAlive > this->m_KeepAlive) // Looks like we need to send another keep alive
+				this->SendKeepAlive();
+		}
+		if(this->m_Timeout > 0.0)
+		{
+			this->m_LastPacketRecived += Elapsed;
+			//std::cout<<"Increasing timeout, timeout at"<<this->m_LastPacketRecived<<"\n";
+			if(this->m_LastPacketRecived > this->m_Timeout)
 			{
-				_this->m_LastPacketRecived += 0.01;
-				//std::cout<<"Increasing timeout, timeout at"<<_this->m_LastPacketRecived<<"\n";
-				if(_this->m_LastPacketRecived > _this->m_Timeout)
-				{
-					if(_this->m_pDisconnected)
-						_this->m_pDisconnected(_this, false);
-					_this->Disconnect();
-				}
+				this->CallDisconnected(false);
+				this->Disconnect();
 			}
-			delete Data;
-			Sleep(10);
 		}
 	}
 	void UDPXConnection::Init()
 	{
-		// TODO create thread for reciving
-		this->m_InitialSequence = 0;
 		this->m_KeepAlive = 0.0;
 		this->m_LastKeepAlive = 0.0;
 		this->m_LastPacketRecived = 0.0;
-		this->m_LastReceiveSequence = 0;
-		this->m_ReciveSequence = 0;
-		this->m_SendSequence = 0;
 		this->m_Timeout = 0.0;
-		//this->m_pSocket = new Socket();
-		this->m_Socket.Open(this->m_pAddress->Port);
-		this->m_IncomingPacketThreadHandle = CreateThread(NULL, NULL, IncomingPacketThread, this, NULL, NULL);
+		this->m_EarlyAccepted = false;
+		this->m_Closed = false;
+		this->m_Disconnecting = false;
+		this->m_HandelerDepth = 0;
+		this->m_pFECEncoder = NULL;
+		this->m_pFECDecoder = NULL;
+		this->m_FECGroup = 0;
+		this->m_FECAge = 0.0;
+		this->m_FECPriority = PriorityNormal;
+		for(int i = 0; i < UDPX_PRIORITYCOUNT; i++)
+			this->m_SendDeficit[i] = 0;
+		this->m_SendClass = PriorityHigh;
+		this->m_SendCharged = false;
+		this->m_SchedulerDeficit = 0;
+		this->m_Scheduled = false;
+		this->m_SendRate = 0.0;
+		this->m_SendTokens = 0.0;
 	}
-	UDPXConnection::UDPXConnection()
+	UDPXConnection::UDPXConnection(Socket* pSocket, const UDPXAddress& Address, unsigned int ConnectionID, int InitialSequence, int InitialReceiveSequence, Listener* Owner)
 	{
+		this->m_pSocket = pSocket;
+		this->m_Address = this->m_HandshakeAddress = Address;
+		this->m_pListener = Owner;
+		this->m_pScheduler = Owner ? &Owner->m_Scheduler : GetIOLoop()->GetClientScheduler();
+		this->m_ConnectionID = ConnectionID;
+		this->m_InitialSequence = this->m_SendSequence = InitialSequence;
+		this->m_InitialReceiveSequence = this->m_ReciveSequence = InitialReceiveSequence;
+		this->m_LastReceiveSequence = InitialReceiveSequence - 1;
+		this->m_KeepAliveCount = 0;
+		this->m_PeerKeepAliveCount = 0;
 		this->Init();
 	}
 	UDPXConnection::~UDPXConnection()
 	{
-		TerminateThread(this->m_IncomingPacketThreadHandle, 0);
-		delete this->m_pAddress;
-		//delete this->m_pSocket;
+		this->Release(); // Nothing left by now, unless the loop went without closing us
 	}
-	UDPXConnection::UDPXConnection(UDPXAddress* Address)
+	void UDPXConnection::Close()
 	{
-		this->m_pAddress = Address;
-		this->Init();
+		// After this only the application's handles can reach us, and they find us closed
+		if(this->m_Closed)
+			return;
+		ConnectionHandle self = this->shared_from_this(); // Leaving the map may drop the last one
+		this->m_Closed = true;
+		if(this->m_pListener)
+			this->m_pListener->RemoveConnection(this);
+		else
+			GetIOLoop()->RemoveConnection(this);
+		this->m_pScheduler->Remove(this);
+		this->Release();
+		if(this->m_HandelerDepth == 0)
+			this->ResetHandelers(); // Otherwise the last handeler to return does it
 	}
-	void UDPXConnection::Send(BYTE* Data)
+	void UDPXConnection::Release()
 	{
-		BYTE* data = new BYTE[sizeof(Data)]; // copy it so it can be disposed
-		for(int i = 0; i < sizeof(Data); i++)
-			data[i] = Data[i];
-		this->SendWithSequence(this->m_SendSequence, data, sizeof(data));
-		this->m_SentPackets[this->m_SendSequence] = data;
-		this->m_SendSequence++;
+		for(int i = 0; i < UDPX_PRIORITYCOUNT; i++)
+		{
+			for(SendQueueType::iterator it = this->m_SendQueues[i].begin(); it != this->m_SendQueues[i].end(); ++it)
+				delete [] it->Data;
+			this->m_SendQueues[i].clear();
+		}
+		for(StoredPacketType::iterator it = this->m_SentPackets.begin(); it != this->m_SentPackets.end(); ++it)
+			delete [] it->second.Data;
+		this->m_SentPackets.clear();
+		this->m_RecivedPackets.clear(); // The views give their packets back to the pool
+		for(size_t i = 0; i < this->m_FECPending.size(); i++)
+			delete [] this->m_FECPending[i].Data;
+		this->m_FECPending.clear();
+		while(!this->m_FECGroups.empty())
+		{
+			FECGroup& group = this->m_FECGroups.begin()->second;
+			for(StoredPacketType::iterator it = group.Data.begin(); it != group.Data.end(); ++it)
+				delete [] it->second.Data;
+			for(StoredPacketType::iterator it = group.Parity.begin(); it != group.Parity.end(); ++it)
+				delete [] it->second.Data;
+			this->m_FECGroups.erase(this->m_FECGroups.begin());
+		}
+		delete this->m_pFECEncoder;
+		this->m_pFECEncoder = NULL;
+		delete this->m_pFECDecoder;
+		this->m_pFECDecoder = NULL;
 	}
-	void UDPXConnection::SendUnchecked(BYTE* Data)
+	void UDPXConnection::Send(BYTE* Data, int Length, SendPriority Priority)
 	{
-		int Length = sizeof(Data);
-		BYTE* pdata = new BYTE[Length + 1];
-		pdata[0] = PacketType::Unsequenced;
-		memccpy(pdata, Data, 1, Length);
-		//for (int t = 0; t < Length; t++)		// TODO: Use memcpy
-		//	pdata[t + 1] = Data[t];
-		this->ResetKeepAlive();
-		this->SendRaw(pdata, Length+1);
+		GetIOLoop()->Lock(); // The I/O thread reads m_SentPackets when answering requests
+		if(!this->IsConnected())
+		{
+			GetIOLoop()->Unlock();
+			return;
+		}
+		StoredPacket stored;
+		stored.Data = new BYTE[Length]; // copy it so it can be disposed
+		stored.Length = Length;
+		memcpy(stored.Data, Data, Length);
+		this->SendWithSequence(this->m_SendSequence, stored.Data, stored.Length, Priority);
+		this->m_SentPackets[this->m_SendSequence] = stored;
+		this->m_SendSequence++;
+		GetIOLoop()->Unlock();
 	}
-	void UDPXConnection::Disconnect(void)
+	void UDPXConnection::SendUnchecked(BYTE* Data, int Length, SendPriority Priority)
 	{
-		BYTE* pdata = new byte[UDPX_PACKETHEADERSIZE];
-		pdata[0] = PacketType::Disconnect;
-		_WriteInt(this->m_SendSequence, pdata, 1);
-		_WriteInt(this->m_ReciveSequence, pdata, 5);
-		this->SendRaw(pdata, 5);
-		delete pdata;
-		delete this;
+		GetIOLoop()->Lock();
+		if(!this->IsConnected())
+		{
+			GetIOLoop()->Unlock();
+			return;
+		}
+		if(this->m_pFECEncoder)
+		{
+			this->m_FECPriority = Priority;
+			BYTE* pdata = new BYTE[Length + UDPX_FECDATAHEADERSIZE];
+			pdata[0] = PacketType::FECData;
+			_WriteInt(this->m_ConnectionID, pdata, 1);
+			_WriteInt(this->m_FECGroup, pdata, 5);
+			pdata[9] = (BYTE)this->m_FECPending.size();
+			memcpy(pdata + UDPX_FECDATAHEADERSIZE, Data, Length);
+			this->ResetKeepAlive();
+			this->SendRaw(pdata, Length + UDPX_FECDATAHEADERSIZE, Priority);
+			delete [] pdata;
+
+			StoredPacket stored;
+			stored.Data = new BYTE[Length];
+			stored.Length = Length;
+			memcpy(stored.Data, Data, Length);
+			this->m_FECPending.push_back(stored);
+			if((int)this->m_FECPending.size() == this->m_pFECEncoder->GetK())
+				this->SendFECParity();
+		}
+		else
+		{
+			BYTE* pdata = new BYTE[Length + UDPX_UNSEQUENCEDHEADERSIZE];
+			pdata[0] = PacketType::Unsequenced;
+			_WriteInt(this->m_ConnectionID, pdata, 1);
+			memcpy(pdata + UDPX_UNSEQUENCEDHEADERSIZE, Data, Length);
+			this->ResetKeepAlive();
+			this->SendRaw(pdata, Length + UDPX_UNSEQUENCEDHEADERSIZE, Priority);
+			delete [] pdata;
+		}
+		GetIOLoop()->Unlock();
 	}
-	void UDPXConnection::SendKeepAlive()
+	void UDPXConnection::SendInPlace(BYTE* Buffer, int Length, SendPriority Priority)
 	{
-		BYTE* pdata = new BYTE[UDPX_PACKETHEADERSIZE];
-		pdata[0] = PacketType::KeepAlive;
-		_WriteInt(this->m_SendSequence - 1, pdata, 1);
-		_WriteInt(this->m_ReciveSequence, pdata, 5);
+		GetIOLoop()->Lock();
+		if(!this->IsConnected())
+		{
+			GetIOLoop()->Unlock();
+			return;
+		}
+		StoredPacket stored;
+		stored.Data = new BYTE[Length]; // Still kept for resending, but that's the only copy
+		stored.Length = Length;
+		memcpy(stored.Data, Buffer + UDPX_SENDHEADROOM, Length);
+		BYTE* pdata = Buffer + UDPX_SENDHEADROOM - UDPX_PACKETHEADERSIZE;
+		pdata[0] = PacketType::Sequenced;
+		_WriteInt(this->m_ConnectionID, pdata, 1);
+		_WriteInt(this->m_SendSequence, pdata, 5);
+		_WriteInt(this->m_ReciveSequence, pdata, 9);
 		this->ResetKeepAlive();
-		this->SendRaw(pdata, UDPX_PACKETHEADERSIZE);
-		delete pdata;
-		std::cout<<"Sent KA\n";
+		this->SendRaw(pdata, Length + UDPX_PACKETHEADERSIZE, Priority);
+		this->m_SentPackets[this->m_SendSequence] = stored;
+		this->m_SendSequence++;
+		GetIOLoop()->Unlock();
 	}
-	void UDPXConnection::SetKeepAlive(double Time)
+	void UDPXConnection::SendUncheckedInPlace(BYTE* Buffer, int Length, SendPriority Priority)
 	{
-		this->m_KeepAlive = Time;
+		GetIOLoop()->Lock();
+		if(this->m_pFECEncoder)
+			this->SendUnchecked(Buffer + UDPX_SENDHEADROOM, Length, Priority); // The group keeps a copy anyway
+		else if(this->IsConnected())
+		{
+			BYTE* pdata = Buffer + UDPX_SENDHEADROOM - UDPX_UNSEQUENCEDHEADERSIZE;
+			pdata[0] = PacketType::Unsequenced;
+			_WriteInt(this->m_ConnectionID, pdata, 1);
+			this->ResetKeepAlive();
+			this->SendRaw(pdata, Length + UDPX_UNSEQUENCEDHEADERSIZE, Priority);
+		}
+		GetIOLoop()->Unlock();
 	}
-	void UDPXConnection::SetTimeout(double Time)
+	void UDPXConnection::SetFEC(int K, int M)
 	{
-		this->m_Timeout = Time;
+		GetIOLoop()->Lock();
+		if(!this->m_FECPending.empty())
+			this->SendFECParity(); // Finish off the group we were on with the old settings
+		delete this->m_pFECEncoder;
+		this->m_pFECEncoder = NULL;
+		if(K > 0 && M > 0 && K + M <= UDPX_FECMAXBLOCKS)
+			this->m_pFECEncoder = new FECCodec(K, M);
+		GetIOLoop()->Unlock();
 	}
-	void UDPXConnection::SetDisconnectEvent(DisconnectedFn fp)
+	void UDPXConnection::SetSendRate(double BytesPerSecond)
 	{
-		this->m_pDisconnected = fp;
+		GetIOLoop()->Lock();
+		this->m_SendRate = BytesPerSecond;
+		this->m_SendTokens = BytesPerSecond * UDPX_BURSTTIME;
+		if(this->m_Scheduled)
+			this->m_pScheduler->Activate(this);
+		GetIOLoop()->Unlock();
 	}
-	void UDPXConnection::SetReceivedPacketEvent(ReceivedPacketFn fp)
+	void UDPXConnection::SendFECParity()
 	{
-		this->m_ReceivedPacket = fp;
+		int k = (int)this->m_FECPending.size();
+		int m = this->m_pFECEncoder->GetM();
+
+		// Every block is the payload's length then the payload, padded to the longest, so a rebuilt block knows its size
+		int size = 0;
+		for(int i = 0; i < k; i++)
+			if(this->m_FECPending[i].Length > size)
+				size = this->m_FECPending[i].Length;
+		size += 2;
+
+		vector<BYTE> blocks(k * size, 0);
+		vector<BYTE*> data(k);
+		for(int i = 0; i < k; i++)
+		{
+			data[i] = &blocks[i * size];
+			data[i][0] = (BYTE)(this->m_FECPending[i].Length >> 8);
+			data[i][1] = (BYTE)this->m_FECPending[i].Length;
+			memcpy(data[i] + 2, this->m_FECPending[i].Data, this->m_FECPending[i].Length);
+			delete [] this->m_FECPending[i].Data;
+		}
+		this->m_FECPending.clear();
+
+		vector<BYTE> packets(m * (UDPX_FECPARITYHEADERSIZE + size));
+		vector<BYTE*> parity(m);
+		for(int i = 0; i < m; i++)
+			parity[i] = &packets[i * (UDPX_FECPARITYHEADERSIZE + size)] + UDPX_FECPARITYHEADERSIZE;
+
+		if(k == this->m_pFECEncoder->GetK())
+			this->m_pFECEncoder->Encode(&data[0], &parity[0], size);
+		else
+		{
+			FECCodec partial(k, m); // Flushed early
+			partial.Encode(&data[0], &parity[0], size);
+		}
+
+		for(int i = 0; i < m; i++)
+		{
+			BYTE* pdata = parity[i] - UDPX_FECPARITYHEADERSIZE;
+			pdata[0] = PacketType::FECParity;
+			_WriteInt(this->m_ConnectionID, pdata, 1);
+			_WriteInt(this->m_FECGroup, pdata, 5);
+			pdata[9] = (BYTE)i;
+			pdata[10] = (BYTE)k;
+			pdata[11] = (BYTE)m;
+			this->SendRaw(pdata, UDPX_FECPARITYHEADERSIZE + size, this->m_FECPriority);
+		}
+		this->m_FECGroup++;
+		this->m_FECAge = 0.0;
 	}
-	void UDPXConnection::SetReceivedPacketOrderdEvent(ReceivedPacketFn fp)
+	void UDPXConnection::ReciveFEC(Packet* pPacket, BYTE* Data, int Length)
 	{
-		this->m_ReceivedPacketOrderd = fp;
+		bool parity = Data[0] == PacketType::FECParity;
+		int header = parity ? UDPX_FECPARITYHEADERSIZE : UDPX_FECDATAHEADERSIZE;
+		if(Length < header)
+			return;
+		int groupid = _ReadInt(Data, 5);
+		int index = Data[9];
+		if(parity)
+		{
+			// K and M size RecoverFEC's arrays and the decoder's matrix, so nothing it can't hold gets that far
+			int k = Data[10];
+			int m = Data[11];
+			if(k < 1 || m < 1 || k + m > UDPX_FECMAXBLOCKS || index >= m || Length - header < 2)
+				return;
+		}
+
+		// Groups are numbered in order, so the oldest is always first
+		if(this->m_FECGroups.size() >= UDPX_FECGROUPWINDOW && this->m_FECGroups.count(groupid) == 0 && groupid < this->m_FECGroups.begin()->first)
+		{
+			if(!parity) // Too late to help rebuild anything, but still worth handing on
+				this->CallReceivedPacket(false, PacketView(pPacket, Data + header, Length - header));
+			return;
+		}
+
+		bool created = this->m_FECGroups.count(groupid) == 0;
+		FECGroup& group = this->m_FECGroups[groupid];
+		if(created)
+			group.K = group.M = 0;
+		StoredPacketType& blocks = parity ? group.Parity : group.Data;
+		if(blocks.count(index) > 0)
+			return; // Already have it (or rebuilt it)
+		if(parity && group.K != 0 && (group.K != Data[10] || group.M != Data[11]))
+			return; // Not the shape the group's other parity said it was
+
+		StoredPacket stored;
+		stored.Length = Length - header;
+		stored.Data = new BYTE[stored.Length];
+		memcpy(stored.Data, Data + header, stored.Length);
+		blocks[index] = stored;
+
+		if(parity)
+		{
+			group.K = Data[10];
+			group.M = Data[11];
+		}
+		else if(this->m_ReceivedPacket)
+		{
+			this->CallReceivedPacket(false, PacketView(pPacket, Data + header, stored.Length));
+			if(this->m_Closed)
+				return; // Disconnected by the handeler
+		}
+
+		this->RecoverFEC(groupid);
+
+		while(this->m_FECGroups.size() > UDPX_FECGROUPWINDOW)
+		{
+			FECGroup& oldest = this->m_FECGroups.begin()->second;
+			for(StoredPacketType::iterator it = oldest.Data.begin(); it != oldest.Data.end(); ++it)
+				delete [] it->second.Data;
+			for(StoredPacketType::iterator it = oldest.Parity.begin(); it != oldest.Parity.end(); ++it)
+				delete [] it->second.Data;
+			this->m_FECGroups.erase(this->m_FECGroups.begin());
+		}
 	}
-	UDPXAddress* UDPXConnection::GetAddress()
+	void UDPXConnection::RecoverFEC(int Group)
 	{
-		return this->m_pAddress;
+		FECGroup& group = this->m_FECGroups[Group];
+		int k = group.K;
+		int m = group.M;
+		if(k == 0 || (int)group.Data.size() >= k || (int)(group.Data.size() + group.Parity.size()) < k)
+			return; // Nothing to do, or not enough to do it with
+
+		int size = group.Parity.begin()->second.Length;
+		vector<BYTE> buffer((k + m) * size, 0);
+		vector<BYTE*> blocks(k + m);
+		bool present[UDPX_FECMAXBLOCKS];
+		for(int i = 0; i < k + m; i++)
+		{
+			blocks[i] = &buffer[i * size];
+			present[i] = false;
+		}
+		for(StoredPacketType::iterator it = group.Data.begin(); it != group.Data.end(); ++it)
+		{
+			if(it->first >= k || it->second.Length + 2 > size)
+				return; // Doesn't belong to this group's shape
+			blocks[it->first][0] = (BYTE)(it->second.Length >> 8);
+			blocks[it->first][1] = (BYTE)it->second.Length;
+			memcpy(blocks[it->first] + 2, it->second.Data, it->second.Length);
+			present[it->first] = true;
+		}
+		for(StoredPacketType::iterator it = group.Parity.begin(); it != group.Parity.end(); ++it)
+		{
+			if(it->first >= m || it->second.Length != size)
+				return;
+			memcpy(blocks[k + it->first], it->second.Data, size);
+			present[k + it->first] = true;
+		}
+
+		if(!this->m_pFECDecoder || this->m_pFECDecoder->GetK() != k || this->m_pFECDecoder->GetM() != m)
+		{
+			delete this->m_pFECDecoder;
+			this->m_pFECDecoder = new FECCodec(k, m);
+		}
+		if(!this->m_pFECDecoder->Decode(&blocks[0], present, size))
+			return;
+
+		for(int i = 0; i < k; i++)
+		{
+			if(present[i])
+				continue;
+			int length = (blocks[i][0] << 8) | blocks[i][1];
+			if(length + 2 > size)
+				continue;
+			StoredPacket stored;
+			stored.Length = length;
+			stored.Data = new BYTE[length];
+			memcpy(stored.Data, blocks[i] + 2, length);
+			group.Data[i] = stored; // So it's not handed out twice if the original turns up late
+			if(this->m_ReceivedPacket)
+			{
+				PacketPool* pool = GetIOLoop()->GetPacketPool();
+				Packet* packet = pool->Alloc();
+				memcpy(packet->Data, stored.Data, length);
+				PacketView view(packet, packet->Data, length);
+				pool->Free(packet); // The view's is the only reference now
+				this->CallReceivedPacket(false, view);
+				if(this->m_Closed)
+					return;
+			}
+		}
 	}
-	bool UDPXConnection::ValidPacket(int RS, int SS)
+	void UDPXConnection::Disconnect(void)
 	{
-		return SS >= this->m_ReciveSequence && SS < this->m_LastReceiveSequence + UDPX_SEQUENCEWINDOW && RS <= this->m_SendSequence && RS > this->m_SendSequence - UDPX_SEQUENCEWINDOW;
+		IOLoop* loop = GetIOLoop();
+		loop->Lock();
+		if(this->IsConnected())
+		{
+			if(!this->m_FECPending.empty())
+				this->SendFECParity(); // Don't leave the tail unprotected
+			if(this->HasQueued())
+				this->m_Disconnecting = true; // The scheduler finishes it once what's queued has gone
+			else
+				this->SendDisconnect();
+		}
+		loop->Unlock();
 	}
-	void UDPXConnection::SendRaw(BYTE* Data, int Length)
+	void UDPXConnection::SendDisconnect()
 	{
-		this->m_Socket.Send(this->m_pAddress, (const char*)Data, Length);
+		BYTE* pdata = new byte[UDPX_PACKETHEADERSIZE];
+		pdata[0] = PacketType::Disconnect;
+		_WriteInt(this->m_ConnectionID, pdata, 1);
+		_WriteInt(this->m_SendSequence, pdata, 5);
+		_WriteInt(this->m_ReciveSequence, pdata, 9);
+		this->m_pSocket->Send(&this->m_Address, (const char*)pdata, UDPX_PACKETHEADERSIZE); // Can't queue it, the queues are going
+		delete [] pdata;
+		this->Close();
+	}
+	bool UDPXConnection::IsConnected()
+	{
+		return !this->m_Closed && !this->m_Disconnecting;
+	}
+	void UDPXConnection::SendKeepAlive()
+	{
+		BYTE* pdata = new BYTE[UDPX_KEEPALIVESIZE];
+		pdata[0] = PacketType::KeepAlive;
+		_WriteInt(this->m_ConnectionID, pdata, 1);
+		_WriteInt(this->m_SendSequence - 1, pdata, 5);
+		_WriteInt(this->m_ReciveSequence, pdata, 9);
+		_WriteInt(++this->m_KeepAliveCount, pdata, 13);
+		this->ResetKeepAlive();
+		this->SendRaw(pdata, UDPX_KEEPALIVESIZE);
+		delete [] pdata;
+		std::cout<<"Sent KA\n";
+	}
+	void UDPXConnection::SetKeepAlive(double Time)
+	{
+		this->m_KeepAlive = Time;
+	}
+	void UDPXConnection::SetTimeout(double Time)
+	{
+		this->m_Timeout = Time;
+	}
+	void UDPXConnection::SetDisconnectEvent(const DisconnectedHandeler& Handeler)
+	{
+		GetIOLoop()->Lock(); // Unlike a function pointer, it can't be swapped out from under the I/O thread
+		if(!this->m_Closed) // There's nothing left to call it for
+			this->m_Disconnected = Handeler;
+		GetIOLoop()->Unlock();
+	}
+	void UDPXConnection::SetReceivedPacketEvent(const ReceivedPacketHandeler& Handeler)
+	{
+		GetIOLoop()->Lock();
+		if(!this->m_Closed)
+			this->m_ReceivedPacket = Handeler;
+		GetIOLoop()->Unlock();
+	}
+	void UDPXConnection::SetReceivedPacketOrderdEvent(const ReceivedPacketHandeler& Handeler)
+	{
+		GetIOLoop()->Lock();
+		if(!this->m_Closed)
+			this->m_ReceivedPacketOrderd = Handeler;
+		GetIOLoop()->Unlock();
+	}
+	void UDPXConnection::SetDisconnectEvent(DisconnectedFn fp)
+	{
+		this->SetDisconnectEvent(_Wrap(fp));
+	}
+	void UDPXConnection::SetReceivedPacketEvent(ReceivedPacketFn fp)
+	{
+		this->SetReceivedPacketEvent(_Wrap(fp));
+	}
+	void UDPXConnection::SetReceivedPacketOrderdEvent(ReceivedPacketFn fp)
+	{
+		this->SetReceivedPacketOrderdEvent(_Wrap(fp));
+	}
+	const UDPXAddress& UDPXConnection::GetAddress()
+	{
+		return this->m_Address;
+	}
+	unsigned int UDPXConnection::GetConnectionID()
+	{
+		return this->m_ConnectionID;
+	}
+	bool UDPXConnection::ValidPacket(int SC, int RC)
+	{
+		return SC >= this->m_ReciveSequence && SC < this->m_LastReceiveSequence + UDPX_SEQUENCEWINDOW && RC <= this->m_SendSequence && RC > this->m_SendSequence - UDPX_SEQUENCEWINDOW;
+	}
+	bool UDPXConnection::ValidKeepAlive(int SC, int RC)
+	{
+		return SC >= this->m_ReciveSequence - 1 && SC < this->m_LastReceiveSequence + UDPX_SEQUENCEWINDOW && RC <= this->m_SendSequence && RC > this->m_SendSequence - UDPX_SEQUENCEWINDOW;
+	}
+	void UDPXConnection::Migrate(UDPXAddress* Sender)
+	{
+		// Only called once a packet has proven itself with valid sequence numbers, and is no older than anything else
+		// the peer's sent (a straggler from the address it's left mustn't take us back), so the peer's NAT has rebound
+		// (or it changed networks); carry on talking to the new address in place.
+		if(*Sender != this->m_Address)
+			this->m_Address = *Sender;
+	}
+	void UDPXConnection::SendRaw(BYTE* Data, int Length, SendPriority Priority)
+	{
+		if(this->m_Closed)
+			return; // A handeler disconnected us while we were still working on a packet
+		// Nothing waiting that could go and nobody over budget, so straight out; otherwise it takes its turn, which comes
+		// straight away unless the socket's out of room. Bulk always waits its turn when the socket can segment, so a
+		// transfer builds up runs that go out in a single send.
+		bool batch = Priority == PriorityBulk && this->m_pSocket->CanSegment();
+		if(!batch && !this->m_pScheduler->IsBusy() && this->CanSend() && this->m_pScheduler->Send(this, Data, Length))
+			return;
+		StoredPacket queued;
+		queued.Data = new BYTE[Length];
+		queued.Length = Length;
+		memcpy(queued.Data, Data, Length);
+		this->m_SendQueues[Priority].push_back(queued);
+		this->m_pScheduler->Activate(this);
+		if(!batch)
+			this->m_pScheduler->Flush();
+		else if(this->m_SendQueues[Priority].size() >= UDPX_MAXSEGMENTS)
+			this->m_pScheduler->Run(0.0); // A full run needn't wait for the loop
+		else
+			GetIOLoop()->Wake(); // A partial one goes once the loop gets the lock, with whatever's joined it by then
+	}
+	bool UDPXConnection::HasQueued()
+	{
+		for(int i = 0; i < UDPX_PRIORITYCOUNT; i++)
+			if(!this->m_SendQueues[i].empty())
+				return true;
+		return false;
+	}
+	int UDPXConnection::NextSendClass()
+	{
+		if(!this->m_SendQueues[PriorityControl].empty())
+			return PriorityControl; // Never waits behind data
+		if(!this->HasQueued())
+			return -1;
+
+		// Deficit round robin between the rest, every turn a class earns its weight in bytes
+		while(true)
+		{
+			int c = this->m_SendClass;
+			SendQueueType& queue = this->m_SendQueues[c];
+			if(queue.empty())
+				this->m_SendDeficit[c] = 0;
+			else
+			{
+				if(!this->m_SendCharged)
+				{
+					this->m_SendDeficit[c] += _PriorityWeight[c] * UDPX_SCHEDULERQUANTUM;
+					this->m_SendCharged = true;
+				}
+				if(queue.front().Length <= this->m_SendDeficit[c])
+					return c;
+			}
+			this->m_SendClass = c + 1 < UDPX_PRIORITYCOUNT ? c + 1 : PriorityHigh;
+			this->m_SendCharged = false;
+		}
+	}
+	void UDPXConnection::PopSend(int Class)
+	{
+		SendQueueType& queue = this->m_SendQueues[Class];
+		if(Class != PriorityControl)
+			this->m_SendDeficit[Class] -= queue.front().Length;
+		delete [] queue.front().Data;
+		queue.pop_front();
+		if(queue.empty())
+			this->m_SendDeficit[Class] = 0;
+	}
+	bool UDPXConnection::CanSend()
+	{
+		return this->m_SendRate <= 0.0 || this->m_SendTokens > 0.0;
+	}
+	void UDPXConnection::ChargeSend(int Length)
+	{
+		if(this->m_SendRate > 0.0)
+			this->m_SendTokens -= Length; // Can go into debt, so a packet bigger than the bucket still gets out
 	}
 	void UDPXConnection::SendRequest(int Sequence)
 	{
-		BYTE* pdata = new BYTE[5];
+		BYTE* pdata = new BYTE[1 + 4 + 4];
 		pdata[0] = PacketType::Request;
-		_WriteInt(Sequence, pdata, 1);
-		this->SendRaw(pdata, 5);
-		delete pdata;
+		_WriteInt(this->m_ConnectionID, pdata, 1);
+		_WriteInt(Sequence, pdata, 5);
+		this->SendRaw(pdata, 1 + 4 + 4);
+		delete [] pdata;
 	}
-	void UDPXConnection::SendWithSequence(int Sequence, BYTE* Data, int Length)
+	void UDPXConnection::SendWithSequence(int Sequence, BYTE* Data, int Length, SendPriority Priority)
 	{
 		BYTE* pdata = new BYTE[Length + UDPX_PACKETHEADERSIZE];
 		pdata[0] = PacketType::Sequenced;
-		_WriteInt(Sequence, pdata, 1);
-		_WriteInt(this->m_ReciveSequence, pdata, 5);
+		_WriteInt(this->m_ConnectionID, pdata, 1);
+		_WriteInt(Sequence, pdata, 5);
+		_WriteInt(this->m_ReciveSequence, pdata, 9);
 		for (int t = 0; t < Length; t++)
 			pdata[t + UDPX_PACKETHEADERSIZE] = Data[t];
 		this->ResetKeepAlive();
-		this->SendRaw(pdata, Length + UDPX_PACKETHEADERSIZE);
-		delete pdata;
+		this->SendRaw(pdata, Length + UDPX_PACKETHEADERSIZE, Priority);
+		delete [] pdata;
 	}
 	void UDPXConnection::ResetKeepAlive()
 	{
@@ -307,34 +1276,138 @@ namespace UDPX
 	}
 	void UDPXConnection::ProcessReciveNumber(int RS)
 	{
-		while (this->m_SentPackets.count(--RS) > 0)
-			this->m_SentPackets.erase(RS);
+		StoredPacketType::iterator it;
+		while ((it = this->m_SentPackets.find(--RS)) != this->m_SentPackets.end())
+		{
+			delete [] it->second.Data;
+			this->m_SentPackets.erase(it);
+		}
+	}
+	void UDPXConnection::ProcessSequenced(int Sequence, const PacketView& Data)
+	{
+		int sc = Sequence;
+
+		// See if this packet is actually needed
+		if (this->m_RecivedPackets.count(sc) > 0)
+			return;
+
+		if (sc > this->m_LastReceiveSequence)
+			this->m_LastReceiveSequence = sc;
+		
+		// Give receive callback
+		this->CallReceivedPacket(true, Data);
+		if (this->m_Closed)
+			return; // Disconnected by the handeler
+		
+		if (sc == this->m_ReciveSequence)
+		{
+			// Give ordered receive packet callback (and update receive numbers).
+			PacketView packet = Data;
+			while (true)
+			{
+				this->m_ReciveSequence++;
+				sc++;
+				if (packet.GetData())
+					this->CallReceivedPacketOrderd(true, packet);
+				if (this->m_Closed)
+					return;
+				
+				ReceivedPacketType::iterator next = this->m_RecivedPackets.find(sc);
+				if (next == this->m_RecivedPackets.end())
+					break; // Don't have the next packet, lets stop here.
+				packet = next->second;
+				this->m_RecivedPackets.erase(next);
+			}
+		}
+		else
+		{
+			// Store the data (if needed), by holding on to the packet it came in rather than copying it
+			this->m_RecivedPackets[sc] = this->m_ReceivedPacketOrderd ? Data : PacketView();
+		}
+
+		// Request all previous packets we need
+		for (int i = this->m_ReciveSequence; i < this->m_LastReceiveSequence; i++)
+			if (!(this->m_RecivedPackets.count(i) > 0))
+				this->SendRequest(i);
+	}
+	void UDPXConnection::CallDisconnected(bool Explict)
+	{
+		if(!this->m_Disconnected)
+			return;
+		ConnectionHandle self = this->shared_from_this();
+		this->m_HandelerDepth++;
+		this->m_Disconnected(self, Explict);
+		if(--this->m_HandelerDepth == 0 && this->m_Closed)
+			this->ResetHandelers(); // Closed from inside a handeler, which had to return first
+	}
+	void UDPXConnection::CallReceivedPacket(bool Checked, const PacketView& Data)
+	{
+		if(!this->m_ReceivedPacket)
+			return;
+		ConnectionHandle self = this->shared_from_this();
+		this->m_HandelerDepth++;
+		this->m_ReceivedPacket(self, Checked, Data);
+		if(--this->m_HandelerDepth == 0 && this->m_Closed)
+			this->ResetHandelers();
+	}
+	void UDPXConnection::CallReceivedPacketOrderd(bool Checked, const PacketView& Data)
+	{
+		if(!this->m_ReceivedPacketOrderd)
+			return;
+		ConnectionHandle self = this->shared_from_this();
+		this->m_HandelerDepth++;
+		this->m_ReceivedPacketOrderd(self, Checked, Data);
+		if(--this->m_HandelerDepth == 0 && this->m_Closed)
+			this->ResetHandelers();
+	}
+	void UDPXConnection::ResetHandelers()
+	{
+		this->m_Disconnected = DisconnectedHandeler();
+		this->m_ReceivedPacket = ReceivedPacketHandeler();
+		this->m_ReceivedPacketOrderd = ReceivedPacketHandeler();
+	}
+	void UDPXConnection::SendTicket(BYTE* Ticket)
+	{
+		BYTE pdata[UDPX_UNSEQUENCEDHEADERSIZE + UDPX_TICKETSIZE];
+		pdata[0] = PacketType::Ticket;
+		_WriteInt(this->m_ConnectionID, pdata, 1);
+		memcpy(pdata + UDPX_UNSEQUENCEDHEADERSIZE, Ticket, UDPX_TICKETSIZE);
+		this->SendRaw(pdata, UDPX_UNSEQUENCEDHEADERSIZE + UDPX_TICKETSIZE);
 	}
-	void UDPXConnection::ReciveRaw(BYTE *Data, int Length)
+	void UDPXConnection::ReciveRaw(Packet* pPacket, BYTE *Data, int Length)
 	{
 		if(Length < 1) return;
 		BYTE type = Data[0];
-		BYTE* pdata;
+		UDPXAddress* Sender = &pPacket->Sender;
+
+		// Everything but the handshake carries our connection id straight after the type
+		if(type != PacketType::Handshake && type != PacketType::HandshakeAck)
+			if(Length < UDPX_UNSEQUENCEDHEADERSIZE || (unsigned int)_ReadInt(Data, 1) != this->m_ConnectionID)
+				return;
+
 		switch(type)
 		{
 			case PacketType::Handshake:
-				BYTE handshakeack[5];
+				// Sent when the listener accepts, and again if our ack got lost
+				BYTE handshakeack[UDPX_HANDSHAKEACKSIZE];
 				handshakeack[0] = PacketType::HandshakeAck;
 				_WriteInt(this->m_InitialSequence, handshakeack, 1);
-				this->SendRaw(handshakeack,5);
-				delete handshakeack;
+				_WriteInt(this->m_ConnectionID, handshakeack, 5);
+				_WriteInt(this->m_InitialReceiveSequence, handshakeack, 9); // So the client knows which connect this answers
+				handshakeack[13] = this->m_EarlyAccepted ? 1 : 0;
+				this->SendRaw(handshakeack, UDPX_HANDSHAKEACKSIZE);
 				break;
 
 			case PacketType::HandshakeAck:
 				break;
 
 			case PacketType::Unsequenced:
-				pdata = new BYTE[Length-1];
-				for (int t = 0; t < Length; t++)
-					pdata[t] = Data[t + 1];
-				if(this->m_ReceivedPacket)
-					this->m_ReceivedPacket(this, false, pdata, Length -1);
-				delete pdata;
+				this->CallReceivedPacket(false, PacketView(pPacket, Data + UDPX_UNSEQUENCEDHEADERSIZE, Length - UDPX_UNSEQUENCEDHEADERSIZE));
+				break;
+
+			case PacketType::FECData:
+			case PacketType::FECParity:
+				this->ReciveFEC(pPacket, Data, Length);
 				break;
 
 			case PacketType::Sequenced:
@@ -342,88 +1415,41 @@ namespace UDPX
 				if (Length < UDPX_PACKETHEADERSIZE)
 					break;
 				
-				// get packet data
-				pdata = new BYTE[Length - UDPX_PACKETHEADERSIZE];
-				for (int t = 0; t < (Length - UDPX_PACKETHEADERSIZE); t++)
-					pdata[t] = Data[t + UDPX_PACKETHEADERSIZE];
-				
-				int sc = _ReadInt(Data, 1);
-				int rc = _ReadInt(Data, 5);
+				int sc = _ReadInt(Data, 5);
+				int rc = _ReadInt(Data, 9);
 				if (this->ValidPacket(sc, rc))
 				{
+					if (sc > this->m_LastReceiveSequence)
+						this->Migrate(Sender);
 					this->ProcessReciveNumber(rc);
-
-					/// This code needs to be C++ified
-					// See if this packet is actually needed
-					if (!(this->m_RecivedPackets.count(sc) > 0))
-					{
-						if (sc > this->m_LastReceiveSequence)
-							this->m_LastReceiveSequence = sc;
-						
-						// Give receive callback
-						if (this->m_ReceivedPacket)
-							this->m_ReceivedPacket(this, true, pdata, (Length - UDPX_PACKETHEADERSIZE));
-						
-						if (sc == this->m_ReciveSequence)
-						{
-							// Give ordered receive packet callback (and update receive numbers).
-							while (true)
-							{
-								this->m_ReciveSequence++;
-								sc++;
-								if (this->m_ReceivedPacketOrderd)
-									this->m_ReceivedPacketOrderd(this, true, pdata, sizeof(pdata));
-								
-								if(this->m_RecivedPackets.count(sc) > 0)
-								{
-									pdata = this->m_RecivedPackets.find(sc)->second;
-									this->m_RecivedPackets.erase(sc);
-								}
-								else break; // Don't have the next packet, lets stop here.
-							}
-						}
-						else
-						{
-							// Store the data (if needed).
-							if (this->m_ReceivedPacketOrderd)
-							{
-								BYTE* packettostore = new BYTE[sizeof(pdata)]; // We need to copy it, it gets deleted after
-								for(int i = 0; i < sizeof(pdata); i++)
-									packettostore[i] = pdata[i];
-								this->m_RecivedPackets[sc] = packettostore;
-							}
-							else
-								this->m_RecivedPackets[sc] = NULL;
-							
-						}
-
-						// Request all previous packets we need
-						for (int i = this->m_ReciveSequence; i < this->m_LastReceiveSequence; i++)
-							if (!(this->m_RecivedPackets.count(sc) > 0))
-								this->SendRequest(i);
-					}
-
-					/// End C++ifide
+					this->ProcessSequenced(sc, PacketView(pPacket, Data + UDPX_PACKETHEADERSIZE, Length - UDPX_PACKETHEADERSIZE));
 				}
-				delete pdata;
 			}break;
 
 			case PacketType::KeepAlive:
 			{
-				if (Length < UDPX_PACKETHEADERSIZE)
+				if (Length < UDPX_KEEPALIVESIZE)
 					break;
 
 				// Decode sequence and receive numbers
-				int sc = _ReadInt(Data, 1); // Contains the last sent sequence number
-				int rc = _ReadInt(Data, 5);
+				int sc = _ReadInt(Data, 5); // Contains the last sent sequence number
+				int rc = _ReadInt(Data, 9);
+				int count = _ReadInt(Data, 13);
 
-				if (this->ValidPacket(sc, rc))
+				if (this->ValidKeepAlive(sc, rc))
 				{
+					// Only one we've not seen before that's no older than the data can move the session; a delayed or
+					// replayed copy of the last one can't
+					if (count > this->m_PeerKeepAliveCount)
+					{
+						this->m_PeerKeepAliveCount = count;
+						if (sc >= this->m_LastReceiveSequence)
+							this->Migrate(Sender);
+					}
 					this->ProcessReciveNumber(rc);
 
-					// Request previous packets that are needed
-					//for (int i = this->m_ReciveSequence; i <= sc; i++)
-					for (int i = this->m_ReciveSequence; i <= rc; i++)
+					// Request previous packets that are needed, up to the last one it sent
+					for (int i = this->m_ReciveSequence; i <= sc; i++)
 					{
 						if (!(this->m_RecivedPackets.count(i) > 0))
 							this->SendRequest(i);
@@ -433,18 +1459,22 @@ namespace UDPX
 
 			case PacketType::Request:
 			{
-				if (Length < 5)
+				if (Length < 1 + 4 + 4)
 					break;
 				
-				int sc = _ReadInt(Data, 1);
+				int sc = _ReadInt(Data, 5);
 
-				// Send out requested packet
-				if (this->m_SentPackets.count(sc) > 0)// this._Sent.TryGetValue(sc, out tosend))
-				{
-					BYTE* tosend = this->m_SentPackets.find(sc)->second;
-					this->SendWithSequence(sc, tosend, sizeof(tosend));
-					delete tosend;
-				}
+				// Send out requested packet, ahead of anything new
+				StoredPacketType::iterator tosend = this->m_SentPackets.find(sc);
+				if (tosend != this->m_SentPackets.end())
+					this->SendWithSequence(sc, tosend->second.Data, tosend->second.Length, PriorityControl);
+			}break;
+
+			case PacketType::Ticket:
+			{
+				// Only clients keep tickets, for a 0-RTT connect next time
+				if (!this->m_pListener && Length == UDPX_UNSEQUENCEDHEADERSIZE + UDPX_TICKETSIZE)
+					GetIOLoop()->StoreTicket(&this->m_Address, Data + UDPX_UNSEQUENCEDHEADERSIZE);
 			}break;
 
 			case PacketType::Disconnect:
@@ -453,14 +1483,14 @@ namespace UDPX
 					break;
 
 				// Decode sequence and receive numbers (to prove this is a valid disconnect).
-				int sc = _ReadInt(Data, 1);
-				int rc = _ReadInt(Data, 5);
+				int sc = _ReadInt(Data, 5);
+				int rc = _ReadInt(Data, 9);
 
 				if (this->ValidPacket(sc, rc))
 				{
-					if (this->m_pDisconnected)
-						this->m_pDisconnected(this, true);
-					delete this; // We don't need ourself anymore
+					this->CallDisconnected(true);
+					this->Close(); // We don't need ourself anymore
+					return;
 				}
 				break;
 			}break;
@@ -468,128 +1498,1167 @@ namespace UDPX
 		this->m_LastPacketRecived = 0.0;
 	}
 
-	void Listen(int Port, ConnectionHandelerFn connection)
+	Listener::Listener(unsigned short Port, const ConnectionHandeler& OnConnect)
+	{
+		this->m_OnConnect = OnConnect;
+		_RandomBytes(this->m_TicketKey, sizeof(this->m_TicketKey));
+		_RandomBytes((BYTE*)&this->m_NextTicketID, sizeof(this->m_NextTicketID));
+		GetIOLoop()->OpenSocket(&this->m_Socket, Port);
+		GetIOLoop()->AddListener(this);
+	}
+	Listener::~Listener()
+	{
+		IOLoop* loop = GetIOLoop();
+		loop->Lock();
+		loop->RemoveListener(this);
+		while(!this->m_Connections.empty())
+		{
+			ConnectionHandle connection = this->m_Connections.begin()->second;
+			connection->Close(); // Removes itself from the map
+		}
+		loop->Unlock();
+		this->m_Socket.Close();
+	}
+	void Listener::SetSendRate(double BytesPerSecond)
+	{
+		GetIOLoop()->Lock();
+		this->m_Scheduler.SetRate(BytesPerSecond);
+		GetIOLoop()->Unlock();
+	}
+	unsigned int Listener::CreateConnectionID()
+	{
+		unsigned int id;
+		do
+			rand_s(&id); // The session key, so it mustn't be guessable
+		while(id == 0 || this->m_Connections.count(id) > 0);
+		return id;
+	}
+	void Listener::IssueTicket(BYTE* Ticket)
+	{
+		_WriteInt(this->m_NextTicketID++, Ticket, 0);
+		_WriteInt((int)(_GetTime() + UDPX_TICKETLIFETIME), Ticket, 4);
+		unsigned long long mac = _SipHash(this->m_TicketKey, Ticket, 8);
+		_WriteInt((int)(mac >> 32), Ticket, 8);
+		_WriteInt((int)mac, Ticket, 12);
+	}
+	bool Listener::RedeemTicket(BYTE* Ticket)
+	{
+		unsigned long long mac = _SipHash(this->m_TicketKey, Ticket, 8);
+		if((unsigned int)_ReadInt(Ticket, 8) != (unsigned int)(mac >> 32) || (unsigned int)_ReadInt(Ticket, 12) != (unsigned int)mac)
+			return false; // Not one of ours
+		
+		double now = _GetTime();
+		double expiry = _ReadInt(Ticket, 4);
+		if(expiry < now)
+			return false;
+
+		// Anything that's expired will be refused anyway, so stop remembering it. Ids are handed out in order of expiry,
+		// so they're all at the front.
+		while(!this->m_UsedTickets.empty() && this->m_UsedTickets.begin()->second < now)
+			this->m_UsedTickets.erase(this->m_UsedTickets.begin());
+
+		unsigned int id = (unsigned int)_ReadInt(Ticket, 0);
+		if(this->m_UsedTickets.count(id) > 0)
+			return false; // Replayed
+		if(this->m_UsedTickets.size() >= UDPX_MAXUSEDTICKETS)
+			return false; // We couldn't spot a replay of it, so make them do a full handshake
+		this->m_UsedTickets[id] = expiry;
+		return true;
+	}
+	void Listener::RemoveConnection(UDPXConnection* Connection)
+	{
+		this->m_Connections.erase(Connection->m_ConnectionID);
+		HandshakeMapType::iterator it = this->m_Handshakes.find(make_pair(Connection->m_HandshakeAddress, Connection->m_InitialReceiveSequence));
+		if(it != this->m_Handshakes.end() && it->second == Connection->m_ConnectionID)
+			this->m_Handshakes.erase(it);
+	}
+	void Listener::Think(double Elapsed)
+	{
+		ConnectionMapType::iterator it = this->m_Connections.begin();
+		while(it != this->m_Connections.end())
+		{
+			ConnectionHandle connection = it->second;
+			++it; // Think may disconnect and remove the connection
+			connection->Think(Elapsed);
+		}
+		this->m_Scheduler.Run(Elapsed);
+	}
+	void Listener::ReciveRaw(Packet* pPacket, BYTE* Data, int Length)
 	{
+		if(Length < 1) return;
+		UDPXAddress* Sender = &pPacket->Sender;
 		
+		if(Data[0] == PacketType::Handshake)
+		{
+			// A resuming handshake carries a ticket, then a count and that many length prefixed payloads
+			bool resuming = Length >= UDPX_HANDSHAKESIZE + UDPX_TICKETSIZE + 1;
+			if(Length != UDPX_HANDSHAKESIZE && !resuming) return;
+			int recvseq = _ReadInt(Data, 1);
+
+			// A retransmitted handshake (our ack got lost) gets the same connection back
+			HandshakeMapType::iterator retransmit = this->m_Handshakes.find(make_pair(*Sender, recvseq));
+			if(retransmit != this->m_Handshakes.end())
+			{
+				ConnectionHandle existing = this->m_Connections[retransmit->second];
+				existing->ReciveRaw(pPacket, Data, Length);
+				return;
+			}
+
+			// A replay makes the choices the capture did, or the rest of the session wouldn't match up
+			ReplayedHandshake replayed;
+			bool replaying = GetIOLoop()->GetReplayedHandshake(Sender, recvseq, &replayed);
+			unsigned int id = replaying ? replayed.ConnectionID : this->CreateConnectionID();
+			int seq = replaying ? replayed.InitialSequence : _CreateInitialSequence();
+			int count = 0;
+			if(resuming)
+			{
+				count = Data[UDPX_HANDSHAKESIZE + UDPX_TICKETSIZE];
+				int offset = UDPX_HANDSHAKESIZE + UDPX_TICKETSIZE + 1;
+				for(int i = 0; i < count && resuming; i++)
+				{
+					if(offset + 2 > Length)
+						resuming = false;
+					else
+						offset += 2 + ((Data[offset] << 8) | Data[offset + 1]);
+				}
+				resuming = resuming && offset == Length && (replaying ? replayed.EarlyAccepted : this->RedeemTicket(Data + UDPX_HANDSHAKESIZE));
+			}
+
+			ConnectionHandle connection(new UDPXConnection(&this->m_Socket, *Sender, id, seq, recvseq, this));
+			this->m_Connections[id] = connection;
+			this->m_Handshakes[make_pair(*Sender, recvseq)] = id;
+			connection->m_EarlyAccepted = resuming;
+			connection->ReciveRaw(pPacket, Data, Length); // Sends the HandshakeAck
+
+			BYTE ticket[UDPX_TICKETSIZE];
+			this->IssueTicket(ticket);
+			connection->SendTicket(ticket);
+
+			if(this->m_OnConnect)
+				this->m_OnConnect(connection);
+
+			// The 0-RTT data goes to the handelers just as if it had arrived straight after the handshake
+			int offset = UDPX_HANDSHAKESIZE + UDPX_TICKETSIZE + 1;
+			for(int i = 0; resuming && i < count; i++)
+			{
+				if(connection->m_Closed)
+					break; // Disconnected by a handeler
+				int length = (Data[offset] << 8) | Data[offset + 1];
+				connection->ProcessSequenced(recvseq + i, PacketView(pPacket, Data + offset + 2, length));
+				offset += 2 + length;
+			}
+			return;
+		}
+
+		// Look the session up by id rather than by address, so a client whose NAT has rebound its port keeps its connection
+		if(Length < UDPX_UNSEQUENCEDHEADERSIZE) return;
+		ConnectionMapType::iterator it = this->m_Connections.find((unsigned int)_ReadInt(Data, 1));
+		if(it != this->m_Connections.end())
+		{
+			ConnectionHandle connection = it->second; // Keeps it alive if this packet disconnects it
+			connection->ReciveRaw(pPacket, Data, Length);
+		}
 	}
-	
-	struct ConnectThreadArugments
+
+	Listener* Listen(int Port, const ConnectionHandeler& connection)
 	{
-		UDPXAddress* Address;
-		ConnectionHandelerFn ConnectionHandeler;
-	};
-	typedef struct PacketQueue
+		return new Listener((unsigned short)Port, connection);
+	}
+	Listener* Listen(int Port, ConnectionHandelerFn connection)
 	{
-		BYTE* Data;
-		int Length;
-		PacketQueue* Next;
-	};
+		return Listen(Port, _Wrap(connection));
+	}
 
-	
-	DWORD WINAPI ConnectThread(void* arg)
+	PacketPool::PacketPool()
+	{
+		this->m_pFree = NULL;
+	}
+	PacketPool::~PacketPool()
+	{
+		for(size_t i = 0; i < this->m_Slabs.size(); i++)
+		{
+			delete [] this->m_Slabs[i];
+			delete [] this->m_Headers[i];
+		}
+	}
+	Packet* PacketPool::Alloc()
+	{
+		if(!this->m_pFree)
+		{
+			const int size = UDPX_MAXPACKETSIZE + UDPX_PACKETHEADERSIZE;
+			BYTE* slab = new BYTE[size * UDPX_POOLSLABSIZE];
+			Packet* headers = new Packet[UDPX_POOLSLABSIZE];
+			for(int i = 0; i < UDPX_POOLSLABSIZE; i++)
+			{
+				headers[i].Data = slab + i * size;
+				headers[i].Slab = (int)this->m_Slabs.size();
+				headers[i].Next = this->m_pFree;
+				this->m_pFree = &headers[i];
+			}
+			this->m_Slabs.push_back(slab);
+			this->m_Headers.push_back(headers);
+		}
+		Packet* packet = this->m_pFree;
+		this->m_pFree = packet->Next;
+		packet->Next = NULL;
+		packet->Length = 0;
+		packet->References = 1;
+		return packet;
+	}
+	void PacketPool::Free(Packet* pPacket)
+	{
+		if(InterlockedDecrement(&pPacket->References) == 0)
+			this->Recycle(pPacket);
+	}
+	void PacketPool::Recycle(Packet* pPacket)
+	{
+		pPacket->Next = this->m_pFree;
+		this->m_pFree = pPacket;
+	}
+	BYTE* PacketPool::GetSlab(int Index)
+	{
+		return this->m_Slabs[Index];
+	}
+	int PacketPool::GetSlabSize()
 	{
-		ConnectThreadArugments* args = (ConnectThreadArugments*)arg;
-		UDPXAddress* Address = args->Address;
-		ConnectionHandelerFn OnConnect = args->ConnectionHandeler;
+		return (UDPX_MAXPACKETSIZE + UDPX_PACKETHEADERSIZE) * UDPX_POOLSLABSIZE;
+	}
 
-		srand(time(NULL));
-		int startsequence = INT_MIN + rand();
-		
-		BYTE pdata[5];
-		pdata[0] = PacketType::Handshake;
-		_WriteInt(startsequence, pdata, 1);
-		
-		Socket s;
-		int Attempts = 5;
-		std::cout<<Attempts;
-		double Timeout = 1.0;
+	PacketView::PacketView()
+	{
+		this->m_pPacket = NULL;
+		this->m_pData = NULL;
+		this->m_Length = 0;
+	}
+	PacketView::PacketView(Packet* pPacket, BYTE* Data, int Length)
+	{
+		InterlockedIncrement(&pPacket->References);
+		this->m_pPacket = pPacket;
+		this->m_pData = Data;
+		this->m_Length = Length;
+	}
+	PacketView::PacketView(const PacketView& Other)
+	{
+		if(Other.m_pPacket)
+			InterlockedIncrement(&Other.m_pPacket->References);
+		this->m_pPacket = Other.m_pPacket;
+		this->m_pData = Other.m_pData;
+		this->m_Length = Other.m_Length;
+	}
+	PacketView::~PacketView()
+	{
+		this->Release();
+	}
+	PacketView& PacketView::operator=(const PacketView& Other)
+	{
+		if(Other.m_pPacket)
+			InterlockedIncrement(&Other.m_pPacket->References); // Before letting ours go, it may be the same packet
+		this->Release();
+		this->m_pPacket = Other.m_pPacket;
+		this->m_pData = Other.m_pData;
+		this->m_Length = Other.m_Length;
+		return *this;
+	}
+	BYTE* PacketView::GetData() const
+	{
+		return this->m_pData;
+	}
+	int PacketView::GetLength() const
+	{
+		return this->m_Length;
+	}
+	void PacketView::Release()
+	{
+		if(!this->m_pPacket)
+			return;
+		if(InterlockedDecrement(&this->m_pPacket->References) == 0)
+		{
+			// The last reference, which can be on any thread; the pool's only touched under the loop's lock
+			IOLoop* loop = GetIOLoop();
+			loop->Lock();
+			loop->GetPacketPool()->Recycle(this->m_pPacket);
+			loop->Unlock();
+		}
+		this->m_pPacket = NULL;
+	}
 
-		PacketQueue* FirstNode = NULL;
-		PacketQueue* LastestNode = NULL;
-		
-		while(Attempts >= 0)
+	SendScheduler::SendScheduler()
+	{
+		this->m_Rate = 0.0;
+		this->m_Tokens = 0.0;
+		this->m_Blocked = false;
+		this->m_Ready = false;
+		this->m_Next = 0;
+	}
+	void SendScheduler::SetRate(double BytesPerSecond)
+	{
+		this->m_Rate = BytesPerSecond;
+		this->m_Tokens = BytesPerSecond * UDPX_BURSTTIME;
+	}
+	bool SendScheduler::IsBusy()
+	{
+		// Connections over their own rate don't count, there's no reason for anyone else to wait behind them
+		return this->m_Blocked || this->m_Ready || (this->m_Rate > 0.0 && this->m_Tokens <= 0.0);
+	}
+	bool SendScheduler::IsBlocked()
+	{
+		return this->m_Blocked;
+	}
+	bool SendScheduler::Send(UDPXConnection* Connection, BYTE* Data, int Length)
+	{
+		if(!Connection->m_pSocket->Send(&Connection->m_Address, (const char*)Data, Length) && WSAGetLastError() == WSAEWOULDBLOCK)
 		{
-			s.Send(Address, (const char*)pdata, 5);
-			--Attempts;
-			
-			while(true)
+			this->m_Blocked = true;
+			return false;
+		}
+		// Anything else failing won't get better by waiting, it's lost just like the network might have lost it
+		Connection->ChargeSend(Length);
+		if(this->m_Rate > 0.0)
+			this->m_Tokens -= Length;
+		return true;
+	}
+	int SendScheduler::SendRun(UDPXConnection* Connection, SendQueueType& Queue)
+	{
+		// Credit is fine for taking turns, but a run mustn't blow through a rate's burst
+		double limit = UDPX_MAXSEGMENTBYTES;
+		if(Connection->m_SendRate > 0.0 && Connection->m_SendTokens < limit)
+			limit = Connection->m_SendTokens;
+		if(this->m_Rate > 0.0 && this->m_Tokens < limit)
+			limit = this->m_Tokens;
+		int count = Connection->m_pSocket->CanSegment() ? _RunLength(Queue, limit) : 1;
+		if(count == 1)
+			return this->Send(Connection, Queue.front().Data, Queue.front().Length) ? 1 : 0;
+
+		int total = 0;
+		for(int i = 0; i < count; i++)
+			total += Queue[i].Length;
+		this->m_RunBuffer.resize(total);
+		int offset = 0;
+		for(int i = 0; i < count; i++)
+		{
+			memcpy(&this->m_RunBuffer[offset], Queue[i].Data, Queue[i].Length);
+			offset += Queue[i].Length;
+		}
+
+		if(!Connection->m_pSocket->SendSegmented(&Connection->m_Address, (const char*)&this->m_RunBuffer[0], total, Queue.front().Length))
+		{
+			if(WSAGetLastError() == WSAEWOULDBLOCK)
 			{
-				std::cout<<"Checking handshake.\n";
-				BYTE packet[UDPX_MAXPACKETSIZE];
-				UDPXAddress* Sender = new UDPXAddress();
-				int recived = s.Receive(Sender, packet, UDPX_MAXPACKETSIZE);
-				
-				if(recived == -1) break;
-				if(!Sender) break;
+				this->m_Blocked = true;
+				return 0;
+			}
+			// Not a full socket, the segmenting itself isn't working. Nothing went, so send them the plain way, from now on too.
+			Connection->m_pSocket->StopSegmenting();
+			int sent = 0;
+			while(sent < count && this->Send(Connection, Queue[sent].Data, Queue[sent].Length))
+				sent++;
+			return sent;
+		}
+		Connection->ChargeSend(total);
+		if(this->m_Rate > 0.0)
+			this->m_Tokens -= total;
+		return count;
+	}
+	void SendScheduler::Activate(UDPXConnection* Connection)
+	{
+		if(Connection->CanSend())
+			this->m_Ready = true;
+		if(Connection->m_Scheduled)
+			return;
+		Connection->m_Scheduled = true;
+		if(Connection->m_SchedulerDeficit > 0)
+			Connection->m_SchedulerDeficit = 0; // Debts from a segmented send still stand
+		this->m_Active.push_back(Connection);
+	}
+	void SendScheduler::Remove(UDPXConnection* Connection)
+	{
+		if(!Connection->m_Scheduled)
+			return;
+		for(size_t i = 0; i < this->m_Active.size(); i++)
+		{
+			if(this->m_Active[i] == Connection)
+			{
+				this->m_Active.erase(this->m_Active.begin() + i);
+				if(i < this->m_Next)
+					this->m_Next--;
+				break;
+			}
+		}
+		Connection->m_Scheduled = false;
+		if(this->m_Active.empty())
+			this->m_Ready = false;
+	}
+	void SendScheduler::Run(double Elapsed)
+	{
+		if(this->m_Rate > 0.0)
+		{
+			this->m_Tokens += this->m_Rate * Elapsed;
+			if(this->m_Tokens > this->m_Rate * UDPX_BURSTTIME)
+				this->m_Tokens = this->m_Rate * UDPX_BURSTTIME;
+		}
+		this->m_Blocked = false; // Worth another go
 
-				std::cout<<Sender->Address<<" in rec\n";
-				printf("%u in class\n", Sender->Address);
-				
-				
-				if(Sender->Address == Address->Address) // make sure it's from the correct person.
+		bool progress = true;
+		while(progress && !this->m_Active.empty())
+		{
+			progress = false;
+			size_t count = this->m_Active.size();
+			for(size_t visited = 0; visited < count && !this->m_Active.empty(); visited++)
+			{
+				if(this->m_Blocked || (this->m_Rate > 0.0 && this->m_Tokens <= 0.0))
+				{
+					this->m_Ready = true;
+					return; // Out of room, carry on from here next time
+				}
+				if(this->m_Next >= this->m_Active.size())
+					this->m_Next = 0;
+
+				UDPXConnection* connection = this->m_Active[this->m_Next];
+				if(!connection->CanSend())
+				{
+					this->m_Next++; // Over its own budget, it keeps its place until it has some more
+					continue;
+				}
+				connection->m_SchedulerDeficit += UDPX_SCHEDULERQUANTUM;
+				progress = true;
+
+				int sendclass;
+				while((sendclass = connection->NextSendClass()) >= 0 && connection->CanSend() && (this->m_Rate <= 0.0 || this->m_Tokens > 0.0))
 				{
-					std::cout<<"Got Packet.\n";
-					if(recived == 5 && packet[0] == PacketType::HandshakeAck)
+					SendQueueType& queue = connection->m_SendQueues[sendclass];
+					if(queue.front().Length > connection->m_SchedulerDeficit)
+						break;
+					// A run goes as one, on credit: the deficits can go negative and it's paid back in later rounds
+					int count = this->SendRun(connection, queue);
+					if(count == 0)
+						break;
+					for(int i = 0; i < count; i++)
 					{
-						std::cout<<"Got Handshake.\n";
-						int recsequence = _ReadInt(packet, 1);
-						UDPXConnection* connection = new UDPXConnection(Sender);
-						connection->m_ReciveSequence = recsequence; // Crashed here.
-						OnConnect(connection);
-						PacketQueue* Node = FirstNode;
-						while(Node)
-						{
-							connection->ReciveRaw(Node->Data, Node->Length);
+						connection->m_SchedulerDeficit -= queue.front().Length;
+						connection->PopSend(sendclass);
+					}
+				}
 
-							PacketQueue* LastNode = Node;
-							Node = Node->Next;
-							delete LastNode;
-						}
-						return 0;
+				if(!connection->HasQueued())
+				{
+					connection->m_Scheduled = false;
+					this->m_Active.erase(this->m_Active.begin() + this->m_Next);
+					if(connection->m_Disconnecting)
+						connection->SendDisconnect(); // Its last data's out, the Disconnect goes behind it
+				}
+				else
+					this->m_Next++;
+			}
+		}
+		this->m_Ready = false; // Whoever's left is over their own rate
+	}
+	void SendScheduler::Flush()
+	{
+		// Nothing's earned between ticks, so it's only worth a go if someone's got budget and the socket has room
+		if(this->m_Ready && !this->m_Blocked)
+			this->Run(0.0);
+	}
+
+	IOLoop* GetIOLoop()
+	{
+		return g_pIOLoop;
+	}
+
+	DWORD WINAPI IOThread(void* arg)
+	{
+		IOLoop* _this = (IOLoop*)arg;
+		_this->Run();
+		return 0;
+	}
+
+	IOLoop::IOLoop(IOBackend Backend, bool BusyPoll)
+	{
+		InitializeCriticalSection(&this->m_Lock);
+		this->m_pRegisteredIO = NULL;
+		this->m_Replaying = Backend == BackendReplay;
+		this->m_Woken = false;
+		this->m_BusyPoll = BusyPoll;
+		this->m_HasUnregistered = false;
+		this->m_IOThreadHandle = NULL;
+		if(this->m_Replaying)
+		{
+			// Nothing to wait on, Replay drives everything from the caller's thread
+			g_Replaying = true;
+			g_ReplayTime = 0.0;
+			this->m_ClientSocket.Detach(0);
+			this->m_Running = false;
+			return;
+		}
+		if(Backend == BackendRegisteredIO)
+			this->m_pRegisteredIO = RegisteredIO::Create(&this->m_Pool, BusyPoll);
+		this->m_ClientSocket.Open(0, this->m_pRegisteredIO != NULL); // Any port will do, it has to be bound before we can wait on it
+		if(this->m_pRegisteredIO && !this->m_pRegisteredIO->AddSocket(&this->m_ClientSocket, NULL))
+		{
+			// Fall back on select with a plain socket
+			delete this->m_pRegisteredIO;
+			this->m_pRegisteredIO = NULL;
+			this->m_ClientSocket.Close();
+			this->m_ClientSocket = Socket();
+			this->m_ClientSocket.Open(0);
+		}
+		this->m_WakeSocket = INVALID_SOCKET;
+		if(!this->m_pRegisteredIO)
+			this->m_WakeSocket = _CreateWakeSocket(&this->m_WakeAddress);
+		this->m_Running = true;
+		this->m_IOThreadHandle = CreateThread(NULL, NULL, IOThread, this, NULL, NULL);
+	}
+	IOLoop::~IOLoop()
+	{
+		this->m_Running = false;
+		if(this->m_IOThreadHandle)
+		{
+			WaitForSingleObject(this->m_IOThreadHandle, INFINITE);
+			CloseHandle(this->m_IOThreadHandle);
+		}
+
+		this->Lock();
+		while(!this->m_PendingConnects.empty())
+			this->EndConnect(this->m_PendingConnects.begin()->second, ConnectionHandle());
+		while(!this->m_ClientConnections.empty())
+		{
+			ConnectionHandle connection = this->m_ClientConnections.begin()->second;
+			connection->Close(); // Removes itself from the map
+		}
+		this->Unlock();
+
+		this->m_ClientSocket.Close();
+		if(this->m_WakeSocket != INVALID_SOCKET)
+			closesocket(this->m_WakeSocket);
+		delete this->m_pRegisteredIO;
+		delete g_pCapture;
+		g_pCapture = NULL;
+		g_Replaying = false;
+		DeleteCriticalSection(&this->m_Lock);
+	}
+	void IOLoop::Wake()
+	{
+		if(this->m_Woken || !this->m_Running)
+			return; // It's coming round anyway, or there's no loop to wake
+		this->m_Woken = true;
+		if(this->m_pRegisteredIO)
+			this->m_pRegisteredIO->Wake();
+		else if(this->m_WakeSocket != INVALID_SOCKET)
+			sendto(this->m_WakeSocket, "", 1, 0, (const sockaddr*)&this->m_WakeAddress, sizeof(this->m_WakeAddress));
+	}
+	void IOLoop::Lock()
+	{
+		EnterCriticalSection(&this->m_Lock);
+	}
+	void IOLoop::Unlock()
+	{
+		LeaveCriticalSection(&this->m_Lock);
+	}
+	PacketPool* IOLoop::GetPacketPool()
+	{
+		return &this->m_Pool;
+	}
+	SendScheduler* IOLoop::GetClientScheduler()
+	{
+		return &this->m_ClientScheduler;
+	}
+	IOBackend IOLoop::GetBackend()
+	{
+		if(this->m_Replaying)
+			return BackendReplay;
+		return this->m_pRegisteredIO ? BackendRegisteredIO : BackendSelect;
+	}
+	void IOLoop::OpenSocket(Socket* pSocket, unsigned short Port)
+	{
+		if(this->m_Replaying)
+			pSocket->Detach(Port);
+		else
+			pSocket->Open(Port, this->m_pRegisteredIO != NULL);
+	}
+	bool IOLoop::StartCapture(const char* Path, unsigned int MaxSize)
+	{
+		this->Lock();
+		CaptureWriter* capture = new CaptureWriter();
+		bool opened = capture->Open(Path, MaxSize, _GetTime());
+		if(opened)
+		{
+			delete g_pCapture;
+			g_pCapture = capture;
+		}
+		else
+			delete capture;
+		this->Unlock();
+		return opened;
+	}
+	void IOLoop::StopCapture()
+	{
+		this->Lock();
+		delete g_pCapture; // Flushes it
+		g_pCapture = NULL;
+		this->Unlock();
+	}
+	bool IOLoop::GetReplayedHandshake(UDPXAddress* Address, int InitialSequence, ReplayedHandshake* pHandshake)
+	{
+		map<UDPXAddress,map<int,ReplayedHandshake> >::iterator client = this->m_ReplayedHandshakes.find(*Address);
+		if(client == this->m_ReplayedHandshakes.end())
+			return false;
+		map<int,ReplayedHandshake>::iterator it = client->second.find(InitialSequence);
+		if(it == client->second.end())
+			return false;
+		*pHandshake = it->second;
+		return true;
+	}
+	int IOLoop::Replay(const char* Path)
+	{
+		if(!this->m_Replaying)
+			return -1;
+		CaptureReader reader;
+		if(!reader.Open(Path))
+			return -1;
+
+		this->Lock();
+		// Connection ids and initial sequences were random, find out what they were from what we sent
+		CaptureRecord record;
+		while(reader.Next(&record))
+		{
+			if(record.Direction != CaptureOut || record.Length < 1)
+				continue;
+			if(record.Data[0] == PacketType::HandshakeAck && record.Length == UDPX_HANDSHAKEACKSIZE)
+			{
+				ReplayedHandshake handshake;
+				handshake.InitialSequence = _ReadInt(record.Data, 1);
+				handshake.ConnectionID = (unsigned int)_ReadInt(record.Data, 5);
+				handshake.EarlyAccepted = record.Data[13] != 0;
+				this->m_ReplayedHandshakes[record.Peer][_ReadInt(record.Data, 9)] = handshake;
+			}
+			else if(record.Data[0] == PacketType::Handshake && record.Length >= UDPX_HANDSHAKESIZE)
+			{
+				deque<int>& connects = this->m_ReplayedConnects[record.Peer];
+				int sequence = _ReadInt(record.Data, 1);
+				if(connects.empty() || connects.back() != sequence) // Retries send the same one
+					connects.push_back(sequence);
+			}
+		}
+
+		reader.Rewind();
+		int count = 0;
+		double last = g_ReplayTime;
+		while(reader.Next(&record))
+		{
+			if(record.Direction != CaptureIn)
+				continue;
+			// The loop's timers go off just as often as they would have between this packet and the last
+			while(last + UDPX_TICK <= record.Time)
+			{
+				g_ReplayTime = last + UDPX_TICK;
+				this->Think(g_ReplayTime, UDPX_TICK);
+				last = g_ReplayTime;
+			}
+			g_ReplayTime = record.Time;
+
+			Listener* owner = NULL;
+			for(size_t i = 0; i < this->m_Listeners.size() && !owner; i++)
+				if(this->m_Listeners[i]->m_Socket.GetPort() == record.LocalPort)
+					owner = this->m_Listeners[i];
+			Packet* packet = this->m_Pool.Alloc();
+			memcpy(packet->Data, record.Data, record.Length);
+			packet->Length = record.Length;
+			packet->Sender = record.Peer;
+			this->Dispatch(packet, owner, 0);
+			count++;
+		}
+		this->Unlock();
+		return count;
+	}
+	void IOLoop::AddListener(Listener* pListener)
+	{
+		this->Lock();
+		this->m_Listeners.push_back(pListener);
+		if(this->m_pRegisteredIO && !this->m_pRegisteredIO->AddSocket(&pListener->m_Socket, pListener))
+		{
+			// Out of request queues or the like, so the loop checks this one with select between completions instead
+			this->m_Unregistered.push_back(pListener);
+			this->m_HasUnregistered = true;
+			this->m_pRegisteredIO->WakeOn(&pListener->m_Socket);
+		}
+		this->Unlock();
+	}
+	void IOLoop::RemoveListener(Listener* pListener)
+	{
+		this->Lock();
+		for(size_t i = 0; i < this->m_Listeners.size(); i++)
+		{
+			if(this->m_Listeners[i] == pListener)
+			{
+				this->m_Listeners.erase(this->m_Listeners.begin() + i);
+				if(this->m_pRegisteredIO)
+					this->m_pRegisteredIO->RemoveSocket(&pListener->m_Socket);
+				break;
+			}
+		}
+		for(size_t i = 0; i < this->m_Unregistered.size(); i++)
+		{
+			if(this->m_Unregistered[i] == pListener)
+			{
+				this->m_Unregistered.erase(this->m_Unregistered.begin() + i);
+				this->m_HasUnregistered = !this->m_Unregistered.empty();
+				break;
+			}
+		}
+		this->Unlock();
+	}
+	void IOLoop::RemoveConnection(UDPXConnection* Connection)
+	{
+		this->Lock();
+		this->m_ClientConnections.erase(Connection->m_ConnectionID);
+		this->Unlock();
+	}
+	void IOLoop::AddConnect(const UDPXAddress& Address, const ConnectionHandeler& OnConnect, BYTE** EarlyData, int* EarlyLengths, int EarlyCount)
+	{
+		this->Lock();
+		PendingConnect* connect = new PendingConnect();
+		connect->Address = Address;
+		connect->OnConnect = OnConnect;
+		deque<int>& replayed = this->m_ReplayedConnects[Address];
+		if(!replayed.empty())
+		{
+			connect->InitialSequence = replayed.front(); // What the captured connect used, so the replayed acks match it
+			replayed.pop_front();
+		}
+		else
+		{
+			do
+				connect->InitialSequence = _CreateInitialSequence();
+			while(this->m_PendingConnects.count(connect->InitialSequence) > 0);
+		}
+		connect->Attempts = 0;
+		for(int i = 0; i < EarlyCount; i++)
+		{
+			if(EarlyLengths[i] > UDPX_MAXPACKETSIZE)
+				continue;
+			StoredPacket payload;
+			payload.Data = new BYTE[EarlyLengths[i]];
+			payload.Length = EarlyLengths[i];
+			memcpy(payload.Data, EarlyData[i], EarlyLengths[i]);
+			connect->Payloads.push_back(payload);
+		}
+
+		// First retry at about 3 RTTs; a host we've not seen before gets a conservative guess
+		double rtt = UDPX_DEFAULTRTT;
+		UDPXAddress host = Address;
+		host.Port = 0;
+		map<UDPXAddress,double>::iterator known = this->m_RoundTripTimes.find(host);
+		if(known != this->m_RoundTripTimes.end())
+			rtt = known->second;
+		connect->Interval = 3.0 * rtt;
+		if(connect->Interval < UDPX_MINHANDSHAKEINTERVAL)
+			connect->Interval = UDPX_MINHANDSHAKEINTERVAL;
+
+		this->m_PendingConnects[connect->InitialSequence] = connect;
+		this->BuildHandshake(connect);
+		this->SendHandshake(connect, _GetTime());
+		this->Unlock();
+	}
+	void IOLoop::StoreTicket(UDPXAddress* Address, BYTE* Ticket)
+	{
+		memcpy(this->m_Tickets[*Address].Data, Ticket, UDPX_TICKETSIZE);
+	}
+	void IOLoop::BuildHandshake(PendingConnect* pConnect)
+	{
+		map<UDPXAddress,ResumptionTicket>::iterator ticket = this->m_Tickets.find(pConnect->Address);
+		bool resuming = !pConnect->Payloads.empty() && ticket != this->m_Tickets.end();
+		BYTE* pdata = new BYTE[resuming ? UDPX_HANDSHAKESIZE + UDPX_TICKETSIZE + 1 + UDPX_MAXZERORTTDATA : UDPX_HANDSHAKESIZE];
+		pdata[0] = PacketType::Handshake;
+		_WriteInt(pConnect->InitialSequence, pdata, 1);
+		pConnect->Handshake.Data = pdata;
+		pConnect->Handshake.Length = UDPX_HANDSHAKESIZE;
+		pConnect->PackedPayloads = 0;
+		if(!resuming)
+			return;
+
+		// Pack what fits of the data into the handshake, each payload sequenced as if sent straight after connecting
+		int offset = UDPX_HANDSHAKESIZE + UDPX_TICKETSIZE + 1;
+		int count = 0;
+		for(deque<StoredPacket>::iterator payload = pConnect->Payloads.begin(); payload != pConnect->Payloads.end() && count < 255; ++payload, count++)
+		{
+			if(offset + 2 + payload->Length > UDPX_HANDSHAKESIZE + UDPX_TICKETSIZE + 1 + UDPX_MAXZERORTTDATA)
+				break;
+			pdata[offset] = (BYTE)(payload->Length >> 8);
+			pdata[offset + 1] = (BYTE)payload->Length;
+			memcpy(pdata + offset + 2, payload->Data, payload->Length);
+			offset += 2 + payload->Length;
+		}
+		if(count == 0)
+			return; // Save the ticket for a connect it's some use to
+
+		memcpy(pdata + UDPX_HANDSHAKESIZE, ticket->second.Data, UDPX_TICKETSIZE);
+		pdata[UDPX_HANDSHAKESIZE + UDPX_TICKETSIZE] = (BYTE)count;
+		pConnect->Handshake.Length = offset;
+		pConnect->PackedPayloads = count;
+		this->m_Tickets.erase(ticket); // Single use, the listener hands us a new one each connection
+	}
+	void IOLoop::SendHandshake(PendingConnect* pConnect, double Now)
+	{
+		this->m_ClientSocket.Send(&pConnect->Address, (const char*)pConnect->Handshake.Data, pConnect->Handshake.Length);
+
+		if(pConnect->Attempts == 0)
+			pConnect->FirstSent = Now;
+		pConnect->Attempts++;
+		pConnect->NextAttempt = Now + pConnect->Interval;
+		pConnect->Interval *= 2.0; // Back off, the path may be lossy or the host busy
+	}
+	int IOLoop::PendingWith(const UDPXAddress& Address)
+	{
+		int count = 0;
+		for(PendingConnectMapType::iterator it = this->m_PendingConnects.begin(); it != this->m_PendingConnects.end(); ++it)
+			if(it->second->Address == Address)
+				count++;
+		return count;
+	}
+	void IOLoop::DropEarly(const UDPXAddress& Address)
+	{
+		EarlyPacketMapType::iterator early = this->m_EarlyPackets.begin();
+		while(early != this->m_EarlyPackets.end())
+		{
+			if(early->second.Sender != Address)
+			{
+				++early;
+				continue;
+			}
+			deque<StoredPacket>& packets = early->second.Packets;
+			for(deque<StoredPacket>::iterator it = packets.begin(); it != packets.end(); ++it)
+				delete [] it->Data;
+			this->m_EarlyPackets.erase(early++);
+		}
+	}
+	void IOLoop::EndConnect(PendingConnect* pConnect, const ConnectionHandle& Connection)
+	{
+		this->m_PendingConnects.erase(pConnect->InitialSequence);
+
+		// Only what was sent to the id we were given is ours. What's left for other ids from this host can go once nothing
+		// pending with it could claim them.
+		deque<StoredPacket> packets;
+		if(Connection)
+		{
+			EarlyPacketMapType::iterator early = this->m_EarlyPackets.find(Connection->m_ConnectionID);
+			if(early != this->m_EarlyPackets.end() && early->second.Sender == pConnect->Address)
+			{
+				packets.swap(early->second.Packets);
+				this->m_EarlyPackets.erase(early);
+			}
+		}
+		if(this->PendingWith(pConnect->Address) == 0)
+			this->DropEarly(pConnect->Address);
+
+		if(pConnect->OnConnect)
+			pConnect->OnConnect(Connection);
+
+		// Now the handeler has had a chance to hook up its events, give the connection anything that came before the ack,
+		// unless it was disconnected from within the handeler. Each goes back into a pool packet, which views of it can share.
+		for(deque<StoredPacket>::iterator it = packets.begin(); it != packets.end(); ++it)
+		{
+			if(Connection && !Connection->m_Closed)
+			{
+				Packet* packet = this->m_Pool.Alloc();
+				memcpy(packet->Data, it->Data, it->Length);
+				packet->Length = it->Length;
+				packet->Sender = pConnect->Address;
+				Connection->ReciveRaw(packet, packet->Data, packet->Length);
+				this->m_Pool.Free(packet);
+			}
+			delete [] it->Data;
+		}
+		for(deque<StoredPacket>::iterator it = pConnect->Payloads.begin(); it != pConnect->Payloads.end(); ++it)
+			delete [] it->Data;
+		delete [] pConnect->Handshake.Data;
+		delete pConnect;
+	}
+	void IOLoop::ReciveClient(Packet* pPacket, BYTE* Data, int Length)
+	{
+		BYTE* data = Data;
+		BYTE type = data[0];
+
+		if(type == PacketType::HandshakeAck)
+		{
+			if(Length == UDPX_HANDSHAKEACKSIZE)
+			{
+				PendingConnectMapType::iterator it = this->m_PendingConnects.find(_ReadInt(data, 9));
+				if(it != this->m_PendingConnects.end() && it->second->Address == pPacket->Sender)
+				{
+					PendingConnect* connect = it->second;
+					if(connect->Attempts == 1) // If we retried we can't tell which handshake this answers
+					{
+						double rtt = _GetTime() - connect->FirstSent;
+						UDPXAddress host = connect->Address;
+						host.Port = 0;
+						map<UDPXAddress,double>::iterator known = this->m_RoundTripTimes.find(host);
+						if(known == this->m_RoundTripTimes.end())
+							this->m_RoundTripTimes[host] = rtt;
+						else
+							known->second = 0.875 * known->second + 0.125 * rtt;
 					}
-					else
+
+					unsigned int id = (unsigned int)_ReadInt(data, 5);
+					ConnectionHandle connection(new UDPXConnection(&this->m_ClientSocket, connect->Address, id, connect->InitialSequence, _ReadInt(data, 1), NULL));
+					this->m_ClientConnections[id] = connection;
+
+					// If the listener took the data in our handshake it's been delivered, but keep it in case it's requested.
+					// Anything it didn't take, or that didn't fit, is sent now.
+					bool accepted = data[13] != 0;
+					int index = 0;
+					for(deque<StoredPacket>::iterator payload = connect->Payloads.begin(); payload != connect->Payloads.end(); ++payload, index++)
 					{
-						PacketQueue* Node = new PacketQueue();
-						Node->Data = packet;
-						Node->Length = recived;
-						Node->Next = NULL;
-						if(!FirstNode)
+						if(accepted && index < connect->PackedPayloads)
 						{
-							FirstNode = Node;
-							LastestNode = Node;
+							connection->m_SentPackets[connection->m_SendSequence++] = *payload; // It's the connection's now
+							payload->Data = NULL;
 						}
 						else
-						{
-							LastestNode->Next = Node;
-							LastestNode = Node;
-						}
+							connection->Send(payload->Data, payload->Length);
 					}
+
+					this->EndConnect(connect, connection);
 				}
 			}
-			Sleep(Timeout * 1000);
+			return;
 		}
-		if(FirstNode) // Lets free any data there may have been
+
+		if(type != PacketType::Handshake && Length >= UDPX_UNSEQUENCEDHEADERSIZE)
 		{
-			PacketQueue* Node = FirstNode;
-			while(Node)
+			ConnectionMapType::iterator it = this->m_ClientConnections.find((unsigned int)_ReadInt(data, 1));
+			if(it != this->m_ClientConnections.end())
+			{
+				ConnectionHandle connection = it->second; // Keeps it alive if this packet disconnects it
+				if(pPacket->Sender == connection->m_Address) // Clients only talk to the server they connected to
+					connection->ReciveRaw(pPacket, data, Length);
+				return;
+			}
+
+			// Nobody has this id yet, it's probably the server talking before our HandshakeAck arrived. With several connects
+			// to the host pending only the ack can say whose it is, so hold on to it by id until then.
+			unsigned int id = (unsigned int)_ReadInt(data, 1);
+			EarlyPackets* packets = NULL;
+			EarlyPacketMapType::iterator early = this->m_EarlyPackets.find(id);
+			if(early == this->m_EarlyPackets.end())
 			{
-				PacketQueue* LastNode = Node;
-				Node = Node->Next;
-				free(LastNode);
+				// The host can only have handed out one id for each connect we've pending with it
+				int ids = 0;
+				for(early = this->m_EarlyPackets.begin(); early != this->m_EarlyPackets.end(); ++early)
+					if(early->second.Sender == pPacket->Sender)
+						ids++;
+				if(ids < this->PendingWith(pPacket->Sender))
+				{
+					packets = &this->m_EarlyPackets[id];
+					packets->Sender = pPacket->Sender;
+				}
+			}
+			else if(early->second.Sender == pPacket->Sender && (int)early->second.Packets.size() < UDPX_MAXEARLYPACKETS)
+				packets = &early->second;
+			if(packets)
+			{
+				StoredPacket stored;
+				stored.Data = new BYTE[Length];
+				stored.Length = Length;
+				memcpy(stored.Data, data, Length);
+				packets->Packets.push_back(stored);
 			}
 		}
-		std::cout<<"Connection timed out.\n";
-		OnConnect(NULL);
-		return 0;
 	}
+	void IOLoop::Drain(Socket* pSocket, Listener* pListener)
+	{
+		while(true)
+		{
+			Packet* packet = this->m_Pool.Alloc();
+			int segment;
+			packet->Length = pSocket->Receive(&packet->Sender, packet->Data, UDPX_MAXPACKETSIZE + UDPX_PACKETHEADERSIZE, &segment);
+			if(packet->Length <= 0)
+			{
+				this->m_Pool.Free(packet);
+				return;
+			}
+			this->Dispatch(packet, pListener, segment);
+		}
+	}
+	void IOLoop::CaptureReceived(Packet* pPacket, Listener* pListener, int Offset, int Length)
+	{
+		unsigned short port = pListener ? pListener->m_Socket.GetPort() : this->m_ClientSocket.GetPort();
+		g_pCapture->Write(_GetTime(), CaptureIn, port, &pPacket->Sender, _PacketConnectionID(pPacket->Data + Offset, Length), pPacket->Data + Offset, Length);
+	}
+	void IOLoop::Dispatch(Packet* pPacket, Listener* pListener, int Segment)
+	{
+		if(Segment > 0 && Segment < pPacket->Length)
+		{
+			// The stack coalesced a run of datagrams from one sender, give them out one at a time as they were sent
+			for(int offset = 0; offset < pPacket->Length; offset += Segment)
+			{
+				int length = pPacket->Length - offset < Segment ? pPacket->Length - offset : Segment;
+				if(g_pCapture)
+					this->CaptureReceived(pPacket, pListener, offset, length);
+				if(pListener)
+					pListener->ReciveRaw(pPacket, pPacket->Data + offset, length); // Views of each share the one packet
+				else
+					this->ReciveClient(pPacket, pPacket->Data + offset, length);
+			}
+			this->m_Pool.Free(pPacket);
+			return;
+		}
 
-	void Connect(UDPXAddress* Address, ConnectionHandelerFn connection)
+		if(g_pCapture)
+			this->CaptureReceived(pPacket, pListener, 0, pPacket->Length);
+		if(pListener)
+			pListener->ReciveRaw(pPacket, pPacket->Data, pPacket->Length);
+		else
+			this->ReciveClient(pPacket, pPacket->Data, pPacket->Length);
+		this->m_Pool.Free(pPacket);
+	}
+	void IOLoop::Think(double Now, double Elapsed)
+	{
+		ConnectionMapType::iterator it = this->m_ClientConnections.begin();
+		while(it != this->m_ClientConnections.end())
+		{
+			ConnectionHandle connection = it->second;
+			++it; // Think may disconnect and remove the connection
+			connection->Think(Elapsed);
+		}
+		this->m_ClientScheduler.Run(Elapsed);
+
+		for(size_t i = 0; i < this->m_Listeners.size(); i++)
+			this->m_Listeners[i]->Think(Elapsed);
+
+		if(g_pCapture)
+			g_pCapture->Flush(); // Once a tick, so a crash loses next to nothing
+
+		PendingConnectMapType::iterator pit = this->m_PendingConnects.begin();
+		while(pit != this->m_PendingConnects.end())
+		{
+			PendingConnect* connect = pit->second;
+			++pit;
+			if(Now < connect->NextAttempt)
+				continue;
+			if(connect->Attempts >= UDPX_HANDSHAKEATTEMPTS)
+				this->EndConnect(connect, ConnectionHandle()); // Timed out
+			else
+				this->SendHandshake(connect, Now);
+		}
+	}
+	void IOLoop::Run()
+	{
+		double last = _GetTime();
+		while(this->m_Running)
+		{
+			if(this->m_pRegisteredIO)
+			{
+				// Receives are already posted, so there's nothing to set up; just wait for completions. A socket whose send
+				// buffer filled up gets another go on the next tick. Busy polling comes through here every spin, so it only
+				// takes the lock for completions, a wake, a tick or listeners left to select (which have nothing to spin on).
+				bool arrived = this->m_pRegisteredIO->Wait(UDPX_TICK);
+				if(!arrived && !this->m_Woken && !this->m_HasUnregistered && _GetTime() - last < UDPX_TICK)
+					continue;
+				this->Lock();
+				bool woken = this->m_Woken;
+				this->m_Woken = false;
+				Listener* owner;
+				Packet* packet;
+				while((packet = this->m_pRegisteredIO->Next(&owner)) != NULL)
+					this->Dispatch(packet, owner, 0);
+				if(!this->m_Unregistered.empty())
+				{
+					// Nothing waits on these, a quick look is enough since their arrivals wake us too
+					fd_set readable;
+					FD_ZERO(&readable);
+					for(size_t i = 0; i < this->m_Unregistered.size(); i++)
+						FD_SET(this->m_Unregistered[i]->m_Socket.GetHandle(), &readable);
+					timeval none;
+					none.tv_sec = 0;
+					none.tv_usec = 0;
+					select(0, &readable, NULL, NULL, &none);
+					for(size_t i = 0; i < this->m_Unregistered.size(); i++)
+						if(FD_ISSET(this->m_Unregistered[i]->m_Socket.GetHandle(), &readable))
+							this->Drain(&this->m_Unregistered[i]->m_Socket, this->m_Unregistered[i]);
+				}
+
+				// The timers only need looking at every tick. A wake's for the schedulers, which Think runs.
+				double now = _GetTime();
+				if(!this->m_BusyPoll || woken || now - last >= UDPX_TICK)
+				{
+					this->Think(now, now - last);
+					last = now;
+				}
+				this->Unlock();
+				continue;
+			}
+
+			fd_set readable;
+			fd_set writable; // Only the sockets whose buffers filled up, so we're back as soon as they've room
+			FD_ZERO(&readable);
+			FD_ZERO(&writable);
+			this->Lock();
+			FD_SET(this->m_ClientSocket.GetHandle(), &readable);
+			if(this->m_WakeSocket != INVALID_SOCKET)
+				FD_SET(this->m_WakeSocket, &readable);
+			if(this->m_ClientScheduler.IsBlocked())
+				FD_SET(this->m_ClientSocket.GetHandle(), &writable);
+			for(size_t i = 0; i < this->m_Listeners.size(); i++)
+			{
+				FD_SET(this->m_Listeners[i]->m_Socket.GetHandle(), &readable);
+				if(this->m_Listeners[i]->m_Scheduler.IsBlocked())
+					FD_SET(this->m_Listeners[i]->m_Socket.GetHandle(), &writable);
+			}
+			this->Unlock();
+
+			// Wake as soon as anything arrives, or often enough to keep the timers honest
+			timeval wait;
+			wait.tv_sec = 0;
+			wait.tv_usec = (long)(UDPX_TICK * 1000000.0);
+			select(0, &readable, &writable, NULL, &wait);
+
+			this->Lock();
+			this->m_Woken = false;
+			if(this->m_WakeSocket != INVALID_SOCKET && FD_ISSET(this->m_WakeSocket, &readable))
+			{
+				char wake[16];
+				while(recv(this->m_WakeSocket, wake, sizeof(wake), 0) > 0);
+			}
+			if(FD_ISSET(this->m_ClientSocket.GetHandle(), &readable))
+				this->Drain(&this->m_ClientSocket, NULL);
+			for(size_t i = 0; i < this->m_Listeners.size(); i++)
+				if(FD_ISSET(this->m_Listeners[i]->m_Socket.GetHandle(), &readable))
+					this->Drain(&this->m_Listeners[i]->m_Socket, this->m_Listeners[i]);
+
+			double now = _GetTime();
+			this->Think(now, now - last);
+			last = now;
+			this->Unlock();
+		}
+	}
+
+	bool StartCapture(const char* Path, unsigned int MaxSize)
+	{
+		return GetIOLoop()->StartCapture(Path, MaxSize);
+	}
+	void StopCapture()
 	{
-		ConnectThreadArugments arg;
-		arg.Address = Address;
-		arg.ConnectionHandeler = connection;
+		GetIOLoop()->StopCapture();
+	}
+	int Replay(const char* Path)
+	{
+		return GetIOLoop()->Replay(Path);
+	}
 
-		CreateThread(NULL,NULL,ConnectThread,&arg,NULL,NULL);
+	void Connect(const UDPXAddress& Address, const ConnectionHandeler& connection)
+	{
+		GetIOLoop()->AddConnect(Address, connection, NULL, NULL, 0);
+	}
+	void Connect(const UDPXAddress& Address, const ConnectionHandeler& connection, BYTE** EarlyData, int* EarlyLengths, int EarlyCount)
+	{
+		GetIOLoop()->AddConnect(Address, connection, EarlyData, EarlyLengths, EarlyCount);
+	}
+	void Connect(UDPXAddress* Address, ConnectionHandelerFn connection)
+	{
+		GetIOLoop()->AddConnect(*Address, _Wrap(connection), NULL, NULL, 0);
+	}
+	void Connect(UDPXAddress* Address, ConnectionHandelerFn connection, BYTE** EarlyData, int* EarlyLengths, int EarlyCount)
+	{
+		GetIOLoop()->AddConnect(*Address, _Wrap(connection), EarlyData, EarlyLengths, EarlyCount);
 	}
 }
 
@@ -5,16 +5,54 @@
 
 #include "winsock2.h"
 #include "windows.h"
+#include "FEC.h"
+#include <deque>
 #include <map>
+#include <vector>
+#include <memory>
+#include <functional>
 
+using std::deque;
 using std::map;
+using std::pair;
+using std::vector;
+using std::tr1::shared_ptr; // TR1, as far as VS2008 SP1 goes
+using std::tr1::enable_shared_from_this;
+using std::tr1::function;
 
-#define UDPX_PACKETHEADERSIZE (1 + 4 + 4)
+#define UDPX_PACKETHEADERSIZE (1 + 4 + 4 + 4) // type, connection id, sequence, receive sequence
+#define UDPX_UNSEQUENCEDHEADERSIZE (1 + 4) // type, connection id
 #define UDPX_MAXPACKETSIZE (65536 - UDPX_PACKETHEADERSIZE)
 #define UDPX_SEQUENCEWINDOW (100)
+#define UDPX_HANDSHAKESIZE (1 + 4) // type, initial sequence
+#define UDPX_KEEPALIVESIZE (UDPX_PACKETHEADERSIZE + 4) // header, keep-alive count
+#define UDPX_HANDSHAKEACKSIZE (1 + 4 + 4 + 4 + 1) // type, initial sequence, connection id, echoed initial sequence, early data accepted
+#define UDPX_HANDSHAKEATTEMPTS (5)
+#define UDPX_DEFAULTRTT (0.1) // Assumed round trip time (seconds) to a host we've not connected to before
+#define UDPX_MINHANDSHAKEINTERVAL (0.02)
+#define UDPX_MAXEARLYPACKETS (32) // How many packets we'll hold on to for one connection id before its HandshakeAck arrives
+#define UDPX_POOLSLABSIZE (16) // Packets allocated at a time by the packet pool
+#define UDPX_TICKETSIZE (4 + 4 + 8) // id, expiry, mac
+#define UDPX_TICKETLIFETIME (600.0) // Seconds a resumption ticket can be redeemed for
+#define UDPX_MAXUSEDTICKETS (4096) // Redeemed tickets a listener remembers to refuse replays; past this it falls back to full handshakes
+#define UDPX_MAXZERORTTDATA (1200) // Payload bytes a resuming Handshake may carry, keeps it inside one MTU
+#define UDPX_FECDATAHEADERSIZE (1 + 4 + 4 + 1) // type, connection id, group, index
+#define UDPX_FECPARITYHEADERSIZE (1 + 4 + 4 + 1 + 1 + 1) // type, connection id, group, index, data blocks, parity blocks
+#define UDPX_SENDHEADROOM (UDPX_PACKETHEADERSIZE) // Room left ahead of the data given to the InPlace sends, enough for any header
+#define UDPX_FECGROUPWINDOW (16) // Groups a receiver holds on to waiting for enough to rebuild them
+#define UDPX_FECFLUSHTIME (0.05) // Seconds a part filled group waits for more data before its parity is sent anyway
+#define UDPX_PRIORITYCOUNT (4)
+#define UDPX_SCHEDULERQUANTUM (1500) // Bytes a backlogged connection (or priority class, times its weight) may send per round
+#define UDPX_BURSTTIME (0.02) // Seconds of a send rate that can be saved up and sent at once
+#define UDPX_TICK (0.01) // Longest the I/O loop sleeps for, which is how often its timers are looked at
+#define UDPX_MAXSEGMENTS (64) // Datagrams handed to the stack in one segmentation offload send
+#define UDPX_MAXSEGMENTBYTES (65507) // The most a single UDP send can carry
 namespace UDPX
 {
 	class UDPXConnection; // This is just for the typedef
+	class Listener;
+	class RegisteredIO;
+	class CaptureWriter;
 
 	enum PacketType : BYTE
     {
@@ -24,20 +62,58 @@ namespace UDPX
         Handshake,
         HandshakeAck,
         KeepAlive,
-        Disconnect
+        Disconnect,
+        Ticket,
+        FECData,
+        FECParity
     };
 
+	// Outgoing packets wait their turn by class. Control (protocol packets and retransmits) always goes first, the rest
+	// share what's left by weight, so a bulk transfer can't starve anything else nor be starved outright.
+	enum SendPriority : BYTE
+	{
+		PriorityControl,
+		PriorityHigh,
+		PriorityNormal,
+		PriorityBulk
+	};
+
+	enum IOBackend
+	{
+		BackendSelect,
+		BackendRegisteredIO, // Windows 8 and up, falls back to select where it's missing
+		BackendReplay // No sockets and no I/O thread, traffic comes from Replay on a clock of its own
+	};
+
 	bool InitSockets();
+	// With BusyPoll the registered I/O loop spins on completions rather than sleeping, a core for lower latency
+	bool InitSockets(IOBackend Backend, bool BusyPoll);
 	void UninitSockets();
 
+	// An IPv4 or IPv6 host and port, passed around and stored by value
 	class UDPXAddress
 	{
 	public:
 		UDPXAddress();
 		UDPXAddress( unsigned char a, unsigned char b, unsigned char c, unsigned char d, unsigned short Port );
 		UDPXAddress( unsigned int Address, unsigned short Port );
-		unsigned int Address;
+		// Address is 16 bytes in network order; an IPv4 mapped one (::ffff:a.b.c.d) comes out as plain IPv4
+		static UDPXAddress FromIPv6(const BYTE* Address, unsigned short Port);
+		static UDPXAddress FromSockaddr(const sockaddr* pAddress);
+		// Dotted IPv4 or IPv6 text, false if it's neither
+		static bool Parse(const char* Text, unsigned short Port, UDPXAddress* pAddress);
+		bool IsIPv6() const;
+		// The 16 byte IPv6 form, IPv4 as ::ffff:a.b.c.d
+		void GetIPv6(BYTE* Address) const;
+		// For a socket of Family, returns its length, or 0 if that socket can't reach us
+		int ToSockaddr(sockaddr_storage* pAddress, int Family) const;
+		bool operator==(const UDPXAddress& Other) const;
+		bool operator!=(const UDPXAddress& Other) const;
+		bool operator<(const UDPXAddress& Other) const;
+		unsigned int Address; // IPv4, not in network byte order
+		BYTE Address6[16]; // IPv6, all 0 for an IPv4 address
 		unsigned short Port;
+		bool IPv6;
 	};
 
 	
@@ -48,69 +124,392 @@ namespace UDPX
 	{
 	public:
 		Socket();
-		bool Open(unsigned short port);
+		bool Open(unsigned short port, bool Registered = false); // Registered sockets are made for registered I/O
+		void Detach(unsigned short port); // Just a port number, sends go nowhere
 		void Close();
 		bool Send(UDPXAddress* destination, const char* data, int size);
-		int Receive(UDPXAddress* sender, void* data, int size);
+		// Sends data as back to back datagrams of segment bytes (the last may be shorter) in one call, split up by the
+		// NIC or the stack. Only if CanSegment.
+		bool SendSegmented(UDPXAddress* destination, const char* data, int size, int segment);
+		// If the stack coalesced several datagrams into data, segment is set to their size, otherwise it's 0
+		int Receive(UDPXAddress* sender, void* data, int size, int* segment = NULL);
+		bool CanSegment();
+		void StopSegmenting(); // The stack claimed it could, but a segmented send failed outright
+		SOCKET GetHandle();
+		unsigned short GetPort();
 	private:
 		SOCKET handle;
+		int family; // AF_INET6 (dual stack) unless the system can't do that
+		unsigned short port;
+		bool segment_send; // UDP segmentation offload
+		bool coalesce_receive; // UDP receive offload
 	};
 
 	void Send(Socket* s, UDPXAddress* address, BYTE* data, int length);
 
-	typedef map<int,BYTE*> StoredPacketType;
+	struct Packet
+	{
+		BYTE* Data;
+		int Length;
+		UDPXAddress Sender;
+		Packet* Next;
+		int Slab; // Which of the pool's slabs it lives in, for registering them with the kernel
+		volatile LONG References; // The loop's, plus any PacketViews of it
+	};
+
+	// Hands out fixed size (UDPX_MAXPACKETSIZE + UDPX_PACKETHEADERSIZE) buffers, they're never given back to the system
+	// until the pool is destroyed, so holding on to a packet is just a free list pop.
+	class PacketPool
+	{
+	public:
+		PacketPool();
+		~PacketPool();
+		Packet*				Alloc(void);
+		// Drops a reference, the packet's only back in the pool once there are none
+		void				Free(Packet* pPacket);
+		void				Recycle(Packet* pPacket);
+		BYTE*				GetSlab(int Index);
+		int					GetSlabSize(void);
+	private:
+		vector<BYTE*>		m_Slabs;
+		vector<Packet*>		m_Headers;
+		Packet*				m_pFree;
+	};
+
+	struct StoredPacket
+	{
+		BYTE* Data;
+		int Length;
+	};
+	typedef map<int,StoredPacket> StoredPacketType;
+	typedef deque<StoredPacket> SendQueueType;
+
+	// Received data, in place in the packet it arrived in. Copies share that packet rather than copying the data, so a
+	// view can be kept for as long as it's wanted, on any thread; the packet goes back to the pool with the last one.
+	// Keep in mind that's a whole pool buffer held per packet, and that views must be gone by UninitSockets.
+	class PacketView
+	{
+	public:
+		PacketView();
+		PacketView(Packet* pPacket, BYTE* Data, int Length);
+		PacketView(const PacketView& Other);
+		~PacketView();
+		PacketView&			operator=(const PacketView& Other);
+		BYTE*				GetData(void) const;
+		int					GetLength(void) const;
+	private:
+		void				Release(void);
+		Packet*				m_pPacket;
+		BYTE*				m_pData;
+		int					m_Length;
+	};
+	typedef map<int,PacketView> ReceivedPacketType;
 
-	class UDPXConnection
+	struct FECGroup
+	{
+		int K; // Unknown (0) until a parity block arrives
+		int M;
+		StoredPacketType Data; // By index, the payload without its length prefix
+		StoredPacketType Parity;
+	};
+	typedef map<int,FECGroup> FECGroupMapType;
+
+	class SendScheduler;
+
+	// The library holds one of these for as long as the connection's up, the application can hold its own for as long as
+	// it likes; once disconnected, a connection ignores whatever it's asked to do.
+	typedef shared_ptr<UDPXConnection> ConnectionHandle;
+	typedef function<void (const ConnectionHandle& Connection)> ConnectionHandeler; // Connection is empty if a connect failed
+	typedef function<void (const ConnectionHandle& Connection, bool Explict)> DisconnectedHandeler;
+	typedef function<void (const ConnectionHandle& Connection, bool Checked, const PacketView& Data)> ReceivedPacketHandeler;
+
+	class UDPXConnection : public enable_shared_from_this<UDPXConnection>
 	{
 	public:
-		friend DWORD (WINAPI ConnectThread)(void*); // This is just so we can access private members from some threads (the connect thread that is not a part of the object
-		friend DWORD (WINAPI IncomingPacketThread)(void*); // and neither is this one)
-		UDPXConnection();
-		UDPXConnection(UDPXAddress* Address);
+		friend class IOLoop;
+		friend class Listener;
+		friend class SendScheduler;
+		// If Owner is NULL this is an outgoing connection on the I/O loop's client socket, otherwise the listener feeds it packets
+		UDPXConnection(Socket* pSocket, const UDPXAddress& Address, unsigned int ConnectionID, int InitialSequence, int InitialReceiveSequence, Listener* Owner);
 		~UDPXConnection();
-		void				Send(BYTE* Data);
-		void				SendUnchecked(BYTE* Data);
+		void				Send(BYTE* Data, int Length, SendPriority Priority = PriorityNormal);
+		void				SendUnchecked(BYTE* Data, int Length, SendPriority Priority = PriorityNormal);
+		// Length bytes of data start UDPX_SENDHEADROOM into Buffer; the header's written in front of it instead of the
+		// data being copied in behind one. Whatever's in the headroom is overwritten.
+		void				SendInPlace(BYTE* Buffer, int Length, SendPriority Priority = PriorityNormal);
+		void				SendUncheckedInPlace(BYTE* Buffer, int Length, SendPriority Priority = PriorityNormal);
+		// Whatever's already been sent or queued still goes out first; the connection closes once it has
 		void				Disconnect(void);
+		bool				IsConnected(void);
 		void				SetKeepAlive(double Time);
 		void				SetTimeout(double Time);
+		void				SetDisconnectEvent(const DisconnectedHandeler& Handeler);
+		void				SetReceivedPacketEvent(const ReceivedPacketHandeler& Handeler);
+		void				SetReceivedPacketOrderdEvent(const ReceivedPacketHandeler& Handeler);
 		void				SetDisconnectEvent(DisconnectedFn fp);
 		void				SetReceivedPacketEvent(ReceivedPacketFn fp);
 		void				SetReceivedPacketOrderdEvent(ReceivedPacketFn fp);
-		UDPXAddress*		GetAddress(void);
+		// Protect unchecked packets with M parity packets for every K sent, so the other side can rebuild up to M lost
+		// ones without a round trip. M = 1 is simple XOR parity; K = 0 turns it off.
+		void				SetFEC(int K, int M);
+		// Cap what this connection sends to BytesPerSecond (0 for no cap), anything over waits in its queues
+		void				SetSendRate(double BytesPerSecond);
+		const UDPXAddress&	GetAddress(void);
+		unsigned int		GetConnectionID(void);
 	private:
-		HANDLE				m_IncomingPacketThreadHandle;
 		void				Init();
-		void				ReciveRaw(BYTE* Data, int Length);
-		bool				ValidPacket(int RS, int SS);
+		void				Close(void);
+		void				Release(void);
+		void				Think(double Elapsed);
+		void				ReciveRaw(Packet* pPacket, BYTE* Data, int Length);
+		void				Migrate(UDPXAddress* Sender);
+		void				ProcessSequenced(int Sequence, const PacketView& Data);
+		// The handelers are only called through these, so once closed they're let go of as soon as none are running
+		void				CallDisconnected(bool Explict);
+		void				CallReceivedPacket(bool Checked, const PacketView& Data);
+		void				CallReceivedPacketOrderd(bool Checked, const PacketView& Data);
+		void				ResetHandelers(void); // They may hold a handle to us, which would keep us alive for good
+		void				SendTicket(BYTE* Ticket);
+		void				SendFECParity(void);
+		void				ReciveFEC(Packet* pPacket, BYTE* Data, int Length);
+		void				RecoverFEC(int Group);
+		bool				ValidPacket(int SC, int RC);
+		// A keep-alive carries the last sequence the peer sent, which is one behind what we expect once we've got it all
+		bool				ValidKeepAlive(int SC, int RC);
 		void				SendRequest(int Sequence);
 		void				SendKeepAlive();
+		void				SendDisconnect(void); // Then closes
 		void				ResetKeepAlive(void);
-		void				SendRaw(BYTE* Data, int Length);
-		void				SendWithSequence(int Sequence, BYTE* Data, int Length);
-		DisconnectedFn		m_pDisconnected;
-		ReceivedPacketFn	m_ReceivedPacket;
-		ReceivedPacketFn	m_ReceivedPacketOrderd;
+		void				SendRaw(BYTE* Data, int Length, SendPriority Priority = PriorityControl);
+		void				SendWithSequence(int Sequence, BYTE* Data, int Length, SendPriority Priority);
+		bool				HasQueued(void);
+		int					NextSendClass(void);
+		void				PopSend(int Class);
+		bool				CanSend(void);
+		void				ChargeSend(int Length);
+		DisconnectedHandeler m_Disconnected;
+		ReceivedPacketHandeler m_ReceivedPacket;
+		ReceivedPacketHandeler m_ReceivedPacketOrderd;
+		int					m_HandelerDepth; // How many handelers are running, it's not safe to reset them until none are
 		double				m_KeepAlive;
 		double				m_LastKeepAlive;
 		double				m_Timeout;
 		double				m_LastPacketRecived;
-		UDPXAddress*		m_pAddress;
-		Socket				m_Socket;
+		UDPXAddress			m_Address;
+		UDPXAddress			m_HandshakeAddress; // Where it was when it connected, m_Address follows it if it moves
+		Socket*				m_pSocket;
+		Listener*			m_pListener;
+		unsigned int		m_ConnectionID;
 		int					m_InitialSequence;
+		int					m_InitialReceiveSequence;
 		int					m_ReciveSequence;
 		int					m_SendSequence;
-		int					m_LastReceiveSequence;
+		int					m_LastReceiveSequence; // The newest the peer's sent us, one before the first until then
+		int					m_KeepAliveCount; // Goes up with every keep-alive we send, so a copy can't pass for a new one
+		int					m_PeerKeepAliveCount; // The highest the peer's sent us, only a higher one can move the session
+		bool				m_EarlyAccepted; // Whether the handshake's 0-RTT data was taken, repeated if our ack needs resending
+		bool				m_Closed;
+		bool				m_Disconnecting; // Disconnect was called with data still queued, which goes out first
 		void				ProcessReciveNumber(int RS);
 		StoredPacketType	m_SentPackets;
-		StoredPacketType	m_RecivedPackets;
+		ReceivedPacketType	m_RecivedPackets; // Empty views if nobody wants them in order
+		FECCodec*			m_pFECEncoder;
+		FECCodec*			m_pFECDecoder; // Kept for the next group with the same shape
+		int					m_FECGroup;
+		double				m_FECAge;
+		vector<StoredPacket> m_FECPending; // Sent this group, waiting for parity
+		FECGroupMapType		m_FECGroups;
+		SendPriority		m_FECPriority; // Parity goes at the priority of the data it covers
+		SendScheduler*		m_pScheduler;
+		SendQueueType		m_SendQueues[UDPX_PRIORITYCOUNT];
+		int					m_SendDeficit[UDPX_PRIORITYCOUNT];
+		int					m_SendClass; // Whose turn it is, between the weighted classes
+		bool				m_SendCharged; // Whether that class has had its quantum this turn
+		int					m_SchedulerDeficit; // Our turn's bytes against the other connections on the socket
+		bool				m_Scheduled;
+		double				m_SendRate;
+		double				m_SendTokens;
 	};
-	
-	DWORD WINAPI ConnectThread(void* arg);
-	DWORD WINAPI IncomingPacketThread(void* arg);
 
+	// Shares one socket's egress between the connections on it, by deficit round robin over those with something queued:
+	// a connection with a deep backlog gets no more bytes a round than one with a single packet waiting. Only backlogged
+	// connections are visited, so thousands of quiet ones cost nothing.
+	class SendScheduler
+	{
+	public:
+		SendScheduler();
+		void				SetRate(double BytesPerSecond);
+		bool				IsBusy(void);
+		bool				IsBlocked(void);
+		bool				Send(UDPXConnection* Connection, BYTE* Data, int Length);
+		// Queues Connection for its turn, or says it can go again now that it's got more of its own rate
+		void				Activate(UDPXConnection* Connection);
+		void				Remove(UDPXConnection* Connection);
+		void				Run(double Elapsed);
+		// Sends what's waiting but could go now, rather than leaving it until the loop's next tick
+		void				Flush(void);
+	private:
+		int					SendRun(UDPXConnection* Connection, SendQueueType& Queue);
+		double				m_Rate; // For the whole socket, 0 for no cap
+		double				m_Tokens;
+		bool				m_Blocked; // The socket's buffer is full, nothing more until it's writable
+		bool				m_Ready; // Someone in m_Active could send, it's not all waiting on its own rate
+		vector<UDPXConnection*> m_Active;
+		size_t				m_Next;
+		vector<BYTE>		m_RunBuffer; // Where runs of packets are put back to back for a segmented send
+	};
+	
 	typedef void (__stdcall *ConnectionHandelerFn)(UDPXConnection* Connection);
-	void Listen(int port, ConnectionHandelerFn connection);
+	typedef map<unsigned int,ConnectionHandle> ConnectionMapType;
+	typedef map<pair<UDPXAddress,int>,unsigned int> HandshakeMapType;
+
+	class Listener
+	{
+	public:
+		friend class IOLoop;
+		friend class UDPXConnection;
+		Listener(unsigned short Port, const ConnectionHandeler& OnConnect);
+		~Listener();
+		// Cap what the listener sends to all of its connections together (0 for no cap), shared out fairly between them
+		void				SetSendRate(double BytesPerSecond);
+	private:
+		void				ReciveRaw(Packet* pPacket, BYTE* Data, int Length);
+		void				Think(double Elapsed);
+		void				RemoveConnection(UDPXConnection* Connection);
+		unsigned int		CreateConnectionID(void);
+		void				IssueTicket(BYTE* Ticket);
+		bool				RedeemTicket(BYTE* Ticket);
+		Socket				m_Socket;
+		SendScheduler		m_Scheduler;
+		ConnectionHandeler	m_OnConnect;
+		ConnectionMapType	m_Connections; // Keyed by connection id, not address, so sessions survive NAT rebinding
+		HandshakeMapType	m_Handshakes; // Client address and initial sequence to connection id, for spotting retransmitted handshakes
+		BYTE				m_TicketKey[16];
+		unsigned int		m_NextTicketID;
+		map<unsigned int,double> m_UsedTickets; // Redeemed ticket id to its expiry, for replay protection
+	};
+
+	struct ResumptionTicket
+	{
+		BYTE Data[UDPX_TICKETSIZE];
+	};
+
+	// A connect in progress, driven by the I/O loop until its HandshakeAck arrives or it runs out of attempts
+	struct PendingConnect
+	{
+		UDPXAddress			Address;
+		ConnectionHandeler	OnConnect;
+		int					InitialSequence;
+		int					Attempts;
+		double				Interval;
+		double				NextAttempt;
+		double				FirstSent;
+		StoredPacket		Handshake; // Built once, every attempt sends the same thing
+		deque<StoredPacket>	Payloads; // Data to send as soon as we can; the first PackedPayloads of it ride in a resuming handshake
+		int					PackedPayloads;
+	};
+	typedef map<int,PendingConnect*> PendingConnectMapType;
+
+	// Packets from a server that beat the HandshakeAck here, kept by the connection id they carry until the ack giving
+	// out that id claims them
+	struct EarlyPackets
+	{
+		UDPXAddress			Sender;
+		deque<StoredPacket>	Packets; // Copied out of the pool, each only as big as it needs to be
+	};
+	typedef map<unsigned int,EarlyPackets> EarlyPacketMapType;
+
+	// What a listener chose for a connection when it was captured, so a replay makes the same choices
+	struct ReplayedHandshake
+	{
+		unsigned int ConnectionID;
+		int InitialSequence;
+		bool EarlyAccepted;
+	};
+
+	// One thread services every socket the library owns: each listener's, and a single client socket all outgoing
+	// connections (and connects in progress) share, told apart by connection id.
+	class IOLoop
+	{
+	public:
+		friend DWORD (WINAPI IOThread)(void*);
+		IOLoop(IOBackend Backend, bool BusyPoll);
+		~IOLoop();
+		void				Lock(void);
+		void				Unlock(void);
+		void				AddListener(Listener* pListener);
+		void				RemoveListener(Listener* pListener);
+		void				AddConnect(const UDPXAddress& Address, const ConnectionHandeler& OnConnect, BYTE** EarlyData, int* EarlyLengths, int EarlyCount);
+		void				StoreTicket(UDPXAddress* Address, BYTE* Ticket);
+		void				RemoveConnection(UDPXConnection* Connection);
+		PacketPool*			GetPacketPool(void);
+		SendScheduler*		GetClientScheduler(void);
+		IOBackend			GetBackend(void);
+		// Has the loop go round now rather than at the end of its tick, called with the lock held
+		void				Wake(void);
+		void				OpenSocket(Socket* pSocket, unsigned short Port);
+		bool				StartCapture(const char* Path, unsigned int MaxSize);
+		void				StopCapture(void);
+		int					Replay(const char* Path);
+		bool				GetReplayedHandshake(UDPXAddress* Address, int InitialSequence, ReplayedHandshake* pHandshake);
+	private:
+		void				Run(void);
+		void				Drain(Socket* pSocket, Listener* pListener);
+		void				Dispatch(Packet* pPacket, Listener* pListener, int Segment);
+		void				CaptureReceived(Packet* pPacket, Listener* pListener, int Offset, int Length);
+		void				ReciveClient(Packet* pPacket, BYTE* Data, int Length);
+		void				Think(double Now, double Elapsed);
+		void				BuildHandshake(PendingConnect* pConnect);
+		void				SendHandshake(PendingConnect* pConnect, double Now);
+		void				EndConnect(PendingConnect* pConnect, const ConnectionHandle& Connection);
+		int					PendingWith(const UDPXAddress& Address);
+		void				DropEarly(const UDPXAddress& Address); // Frees what's held for every id from Address
+		CRITICAL_SECTION	m_Lock;
+		HANDLE				m_IOThreadHandle;
+		volatile bool		m_Running;
+		PacketPool			m_Pool;
+		RegisteredIO*		m_pRegisteredIO; // NULL when we're using select
+		bool				m_Replaying;
+		volatile bool		m_Woken; // Wake's been called since the loop last went round
+		bool				m_BusyPoll;
+		Socket				m_ClientSocket;
+		SOCKET				m_WakeSocket; // Select only, Wake sends it a byte from itself on loopback
+		sockaddr_in			m_WakeAddress;
+		SendScheduler		m_ClientScheduler;
+		ConnectionMapType	m_ClientConnections;
+		PendingConnectMapType m_PendingConnects; // Keyed by our initial sequence, which the HandshakeAck echoes
+		EarlyPacketMapType	m_EarlyPackets; // Only from hosts we've a connect pending with
+		vector<Listener*>	m_Listeners;
+		vector<Listener*>	m_Unregistered; // Listeners registered I/O couldn't take, left to select
+		volatile bool		m_HasUnregistered; // So a busy poll can tell without the lock
+		map<UDPXAddress,double> m_RoundTripTimes; // Smoothed handshake RTT per host (port 0), to time the next connect's retries
+		map<UDPXAddress,ResumptionTicket> m_Tickets; // The latest ticket each listener gave us, good for one 0-RTT connect
+		map<UDPXAddress,map<int,ReplayedHandshake> > m_ReplayedHandshakes; // By client and its initial sequence
+		map<UDPXAddress,deque<int> > m_ReplayedConnects; // Our initial sequences for each host, in the order we connected
+	};
+
+	DWORD WINAPI IOThread(void* arg);
+	IOLoop* GetIOLoop(void);
+
+	Listener* Listen(int port, const ConnectionHandeler& connection);
+	void Connect(const UDPXAddress& Address, const ConnectionHandeler& connection);
+	// If we hold a resumption ticket for Address, as much of EarlyData as fits travels inside the Handshake and reaches the
+	// other side's handelers with no round trip; otherwise it's all sent as soon as the connection is made.
+	void Connect(const UDPXAddress& Address, const ConnectionHandeler& connection, BYTE** EarlyData, int* EarlyLengths, int EarlyCount);
+
+	// The function pointer forms; Address is copied, not kept
+	Listener* Listen(int port, ConnectionHandelerFn connection);
 	void Connect(UDPXAddress* Address, ConnectionHandelerFn connection);
+	void Connect(UDPXAddress* Address, ConnectionHandelerFn connection, BYTE** EarlyData, int* EarlyLengths, int EarlyCount);
+
+	// Record every datagram sent and received, with when and which connection, to a ring file at Path that never grows
+	// past MaxSize bytes; the oldest records are written over.
+	bool StartCapture(const char* Path, unsigned int MaxSize);
+	void StopCapture(void);
+	// Feeds a capture's received datagrams back through the protocol engine as fast as they'll go, the clock following
+	// the capture's timestamps. Needs InitSockets(BackendReplay, false) and the Listen (and Connect) calls the captured
+	// process made. Returns how many were replayed, or -1 if the capture can't be read.
+	int Replay(const char* Path);
 }
 
 #endif // UDPX_H
@@ -0,0 +1,478 @@
+#ifndef UDPX_CODEC_H
+#define UDPX_CODEC_H
+
+#include "UDPX.h"
+#include <string>
+
+using std::string;
+using std::wstring;
+
+#define UDPX_CODECSTACKSIZE (1024) // Messages up to this size are encoded on the stack by EncodeAndSend
+
+namespace UDPX
+{
+	// Messages declare their fields once, in a template that every stream below runs through:
+	//
+	//	struct Move
+	//	{
+	//		int Id;
+	//		float X;
+	//		bool Running;
+	//		template<class Stream> void Serialize(Stream& s)
+	//		{
+	//			s.Int(this->Id);
+	//			s.Quantized(this->X, -1000.0f, 1000.0f, 20);
+	//			s.Flag(this->Running);
+	//		}
+	//	};
+	//
+	// Each stream gets its own instance of Serialize, so a field costs an inlined call rather than a virtual one.
+	// Byte, Bool, the ints, String and WString are the same bytes the C# ByteStreamWriter writes (little endian, bools
+	// as a byte, strings as an int length then the bytes). Flag, Bits, VarUInt, VarInt and Quantized are packed
+	// together, low bit first, and the byte they end in is padded out before the next of the others.
+
+	// Writes into a caller's buffer; nothing past Capacity is touched, the writer just remembers it ran out.
+	class WireWriter
+	{
+	public:
+		WireWriter(BYTE* Buffer, int Capacity)
+		{
+			this->m_pData = Buffer;
+			this->m_Capacity = Capacity;
+			this->m_Position = 0;
+			this->m_Bits = 0;
+			this->m_BitCount = 0;
+			this->m_Overflow = false;
+		}
+		// The length written, or -1 if it didn't fit
+		int Finish()
+		{
+			this->Align();
+			return this->m_Overflow ? -1 : this->m_Position;
+		}
+
+		void Byte(BYTE& Value)
+		{
+			BYTE* pdata = this->Reserve(1);
+			if(pdata)
+				pdata[0] = Value;
+		}
+		void Bool(bool& Value)
+		{
+			BYTE value = Value ? 1 : 0;
+			this->Byte(value);
+		}
+		void Short(short& Value)
+		{
+			this->Write((unsigned short)Value, 2);
+		}
+		void UShort(unsigned short& Value)
+		{
+			this->Write(Value, 2);
+		}
+		void Int(int& Value)
+		{
+			this->Write((unsigned int)Value, 4);
+		}
+		void UInt(unsigned int& Value)
+		{
+			this->Write(Value, 4);
+		}
+		void Long(LONGLONG& Value)
+		{
+			this->Write((ULONGLONG)Value, 8);
+		}
+		void ULong(ULONGLONG& Value)
+		{
+			this->Write(Value, 8);
+		}
+		void Float(float& Value)
+		{
+			union { float f; unsigned int i; } bits; // IEEE single, as BitConverter has it
+			bits.f = Value;
+			this->Write(bits.i, 4);
+		}
+		void Bytes(BYTE* Data, int Length)
+		{
+			BYTE* pdata = this->Reserve(Length);
+			if(pdata)
+				memcpy(pdata, Data, Length);
+		}
+		// ASCII
+		void String(string& Value)
+		{
+			int length = (int)Value.size();
+			this->Int(length);
+			this->Bytes((BYTE*)Value.data(), length);
+		}
+		// UTF-16, as C#'s Encoding.Unicode
+		void WString(wstring& Value)
+		{
+			int length = (int)Value.size() * 2;
+			this->Int(length);
+			BYTE* pdata = this->Reserve(length);
+			for(int i = 0; pdata && i < length / 2; i++)
+			{
+				pdata[i * 2] = (BYTE)Value[i];
+				pdata[i * 2 + 1] = (BYTE)(Value[i] >> 8);
+			}
+		}
+
+		void Flag(bool& Value)
+		{
+			this->WriteBits(Value ? 1 : 0, 1);
+		}
+		// The low Count (1 to 32) bits of Value
+		void Bits(unsigned int& Value, int Count)
+		{
+			this->WriteBits(Value, Count);
+		}
+		// 7 bits at a time, so small values take a byte
+		void VarUInt(unsigned int& Value)
+		{
+			unsigned int value = Value;
+			while(value >= 0x80)
+			{
+				this->WriteBits((value & 0x7f) | 0x80, 8);
+				value >>= 7;
+			}
+			this->WriteBits(value, 8);
+		}
+		// Zigzagged first, so small negative values are small too
+		void VarInt(int& Value)
+		{
+			unsigned int value = ((unsigned int)Value << 1) ^ (unsigned int)(Value >> 31);
+			this->VarUInt(value);
+		}
+		// Value clamped to Min..Max and rounded to one of 2^Count (1 to 32) evenly spaced steps
+		void Quantized(float& Value, float Min, float Max, int Count)
+		{
+			double steps = (double)(((ULONGLONG)1 << Count) - 1);
+			double value = Value < Min ? Min : (Value > Max ? Max : Value);
+			this->WriteBits((unsigned int)((value - Min) / (Max - Min) * steps + 0.5), Count);
+		}
+	private:
+		BYTE* Reserve(int Length)
+		{
+			this->Align();
+			if(this->m_Overflow || Length > this->m_Capacity - this->m_Position)
+			{
+				this->m_Overflow = true;
+				return NULL;
+			}
+			BYTE* pdata = this->m_pData + this->m_Position;
+			this->m_Position += Length;
+			return pdata;
+		}
+		void Write(ULONGLONG Value, int Length)
+		{
+			BYTE* pdata = this->Reserve(Length);
+			if(!pdata)
+				return;
+			for(int i = 0; i < Length; i++)
+				pdata[i] = (BYTE)(Value >> (i * 8));
+		}
+		void WriteBits(unsigned int Value, int Count)
+		{
+			this->m_Bits |= (ULONGLONG)(Value & (unsigned int)((((ULONGLONG)1) << Count) - 1)) << this->m_BitCount;
+			this->m_BitCount += Count;
+			if(this->m_BitCount < 8)
+				return;
+			// Whole bytes go out as soon as there are any
+			int bytes = this->m_BitCount / 8;
+			if(this->m_Overflow || bytes > this->m_Capacity - this->m_Position)
+			{
+				this->m_Overflow = true;
+				this->m_Bits = 0;
+				this->m_BitCount = 0;
+				return;
+			}
+			for(int i = 0; i < bytes; i++)
+				this->m_pData[this->m_Position++] = (BYTE)(this->m_Bits >> (i * 8));
+			this->m_Bits >>= bytes * 8;
+			this->m_BitCount -= bytes * 8;
+		}
+		void Align()
+		{
+			if(this->m_BitCount == 0)
+				return;
+			this->m_BitCount = 8; // Pads out the byte, which WriteBits then writes
+			this->WriteBits(0, 0);
+		}
+		BYTE*		m_pData;
+		int			m_Capacity;
+		int			m_Position;
+		ULONGLONG	m_Bits; // Written, but not yet a whole byte
+		int			m_BitCount;
+		bool		m_Overflow;
+	};
+
+	// Reads what a WireWriter wrote. Like the C# reader, running off the end reads zeros; Finish says if that happened.
+	class WireReader
+	{
+	public:
+		WireReader(const BYTE* Data, int Length)
+		{
+			this->m_pData = Data;
+			this->m_Length = Length;
+			this->m_Position = 0;
+			this->m_Bits = 0;
+			this->m_BitCount = 0;
+			this->m_Error = false;
+		}
+		// False if the message was short, or a length in it was nonsense
+		bool Finish()
+		{
+			return !this->m_Error;
+		}
+
+		void Byte(BYTE& Value)
+		{
+			const BYTE* pdata = this->Take(1);
+			Value = pdata ? pdata[0] : 0;
+		}
+		void Bool(bool& Value)
+		{
+			BYTE value;
+			this->Byte(value);
+			Value = value != 0;
+		}
+		void Short(short& Value)
+		{
+			Value = (short)this->Read(2);
+		}
+		void UShort(unsigned short& Value)
+		{
+			Value = (unsigned short)this->Read(2);
+		}
+		void Int(int& Value)
+		{
+			Value = (int)this->Read(4);
+		}
+		void UInt(unsigned int& Value)
+		{
+			Value = (unsigned int)this->Read(4);
+		}
+		void Long(LONGLONG& Value)
+		{
+			Value = (LONGLONG)this->Read(8);
+		}
+		void ULong(ULONGLONG& Value)
+		{
+			Value = this->Read(8);
+		}
+		void Float(float& Value)
+		{
+			union { float f; unsigned int i; } bits;
+			bits.i = (unsigned int)this->Read(4);
+			Value = bits.f;
+		}
+		void Bytes(BYTE* Data, int Length)
+		{
+			const BYTE* pdata = this->Take(Length);
+			if(pdata)
+				memcpy(Data, pdata, Length);
+			else
+				memset(Data, 0, Length);
+		}
+		void String(string& Value)
+		{
+			int length;
+			this->Int(length);
+			const BYTE* pdata = this->Take(length);
+			if(pdata)
+				Value.assign((const char*)pdata, length);
+			else
+				Value.clear();
+		}
+		void WString(wstring& Value)
+		{
+			int length;
+			this->Int(length);
+			const BYTE* pdata = this->Take(length);
+			Value.clear();
+			if(!pdata)
+				return;
+			Value.resize(length / 2);
+			for(int i = 0; i < length / 2; i++)
+				Value[i] = (wchar_t)(pdata[i * 2] | (pdata[i * 2 + 1] << 8));
+		}
+
+		void Flag(bool& Value)
+		{
+			Value = this->ReadBits(1) != 0;
+		}
+		void Bits(unsigned int& Value, int Count)
+		{
+			Value = this->ReadBits(Count);
+		}
+		void VarUInt(unsigned int& Value)
+		{
+			Value = 0;
+			for(int shift = 0; shift < 35; shift += 7)
+			{
+				unsigned int part = this->ReadBits(8);
+				Value |= (part & 0x7f) << shift;
+				if(part < 0x80)
+					return;
+			}
+			this->m_Error = true; // Longer than any int
+		}
+		void VarInt(int& Value)
+		{
+			unsigned int value;
+			this->VarUInt(value);
+			Value = (int)(value >> 1) ^ -(int)(value & 1);
+		}
+		void Quantized(float& Value, float Min, float Max, int Count)
+		{
+			double steps = (double)(((ULONGLONG)1 << Count) - 1);
+			Value = (float)(Min + this->ReadBits(Count) / steps * (Max - Min));
+		}
+	private:
+		const BYTE* Take(int Length)
+		{
+			this->m_Bits = 0; // Whatever was left of the last packed byte was padding
+			this->m_BitCount = 0;
+			if(Length < 0 || Length > this->m_Length - this->m_Position)
+			{
+				this->m_Error = true;
+				this->m_Position = this->m_Length;
+				return NULL;
+			}
+			const BYTE* pdata = this->m_pData + this->m_Position;
+			this->m_Position += Length;
+			return pdata;
+		}
+		ULONGLONG Read(int Length)
+		{
+			const BYTE* pdata = this->Take(Length);
+			ULONGLONG value = 0;
+			for(int i = 0; pdata && i < Length; i++)
+				value |= (ULONGLONG)pdata[i] << (i * 8);
+			return value;
+		}
+		unsigned int ReadBits(int Count)
+		{
+			while(this->m_BitCount < Count)
+			{
+				BYTE next = 0;
+				if(this->m_Position < this->m_Length)
+					next = this->m_pData[this->m_Position++];
+				else
+					this->m_Error = true;
+				this->m_Bits |= (ULONGLONG)next << this->m_BitCount;
+				this->m_BitCount += 8;
+			}
+			unsigned int value = (unsigned int)(this->m_Bits & ((((ULONGLONG)1) << Count) - 1));
+			this->m_Bits >>= Count;
+			this->m_BitCount -= Count;
+			return value;
+		}
+		const BYTE*	m_pData;
+		int			m_Length;
+		int			m_Position;
+		ULONGLONG	m_Bits; // Read, but not yet handed out
+		int			m_BitCount;
+		bool		m_Error;
+	};
+
+	// Runs a message through without writing anything, to find out how big it'll be
+	class WireSizer
+	{
+	public:
+		WireSizer()
+		{
+			this->m_Bits = 0;
+		}
+		int Finish()
+		{
+			return (int)((this->m_Bits + 7) / 8);
+		}
+
+		void Byte(BYTE& Value) { this->Add(1); }
+		void Bool(bool& Value) { this->Add(1); }
+		void Short(short& Value) { this->Add(2); }
+		void UShort(unsigned short& Value) { this->Add(2); }
+		void Int(int& Value) { this->Add(4); }
+		void UInt(unsigned int& Value) { this->Add(4); }
+		void Long(LONGLONG& Value) { this->Add(8); }
+		void ULong(ULONGLONG& Value) { this->Add(8); }
+		void Float(float& Value) { this->Add(4); }
+		void Bytes(BYTE* Data, int Length) { this->Add(Length); }
+		void String(string& Value) { this->Add(4 + (int)Value.size()); }
+		void WString(wstring& Value) { this->Add(4 + (int)Value.size() * 2); }
+
+		void Flag(bool& Value) { this->m_Bits += 1; }
+		void Bits(unsigned int& Value, int Count) { this->m_Bits += Count; }
+		void VarUInt(unsigned int& Value)
+		{
+			unsigned int value = Value;
+			this->m_Bits += 8;
+			for(; value >= 0x80; value >>= 7)
+				this->m_Bits += 8;
+		}
+		void VarInt(int& Value)
+		{
+			unsigned int value = ((unsigned int)Value << 1) ^ (unsigned int)(Value >> 31);
+			this->VarUInt(value);
+		}
+		void Quantized(float& Value, float Min, float Max, int Count) { this->m_Bits += Count; }
+	private:
+		void Add(int Length)
+		{
+			this->m_Bits = (this->m_Bits + 7) / 8 * 8 + Length * 8;
+		}
+		ULONGLONG	m_Bits;
+	};
+
+	template<class T> int EncodedSize(T& Message)
+	{
+		WireSizer sizer;
+		Message.Serialize(sizer);
+		return sizer.Finish();
+	}
+	// The length written, or -1 if Capacity wasn't enough
+	template<class T> int Encode(T& Message, BYTE* Buffer, int Capacity)
+	{
+		WireWriter writer(Buffer, Capacity);
+		Message.Serialize(writer);
+		return writer.Finish();
+	}
+	template<class T> bool Decode(T& Message, const BYTE* Data, int Length)
+	{
+		WireReader reader(Data, Length);
+		Message.Serialize(reader);
+		return reader.Finish();
+	}
+	template<class T> bool Decode(T& Message, const PacketView& Data)
+	{
+		return Decode(Message, Data.GetData(), Data.GetLength());
+	}
+
+	// Encodes straight into the send buffer's headroom, so the only copy made is the one kept for resending
+	template<class T> bool EncodeAndSend(const ConnectionHandle& Connection, T& Message, bool Checked, SendPriority Priority = PriorityNormal)
+	{
+		int size = EncodedSize(Message);
+		if(size > UDPX_MAXPACKETSIZE)
+			return false;
+		BYTE stack[UDPX_SENDHEADROOM + UDPX_CODECSTACKSIZE];
+		vector<BYTE> large;
+		BYTE* buffer = stack;
+		if(size > UDPX_CODECSTACKSIZE)
+		{
+			large.resize(UDPX_SENDHEADROOM + size);
+			buffer = &large[0];
+		}
+		int length = Encode(Message, buffer + UDPX_SENDHEADROOM, size);
+		if(length < 0)
+			return false;
+		if(Checked)
+			Connection->SendInPlace(buffer, length, Priority);
+		else
+			Connection->SendUncheckedInPlace(buffer, length, Priority);
+		return true;
+	}
+}
+
+#endif // UDPX_CODEC_H
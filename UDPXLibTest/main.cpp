@@ -14,20 +14,20 @@ using namespace std;
 
 bool Exit = false;
 
-void __stdcall Disconnected(UDPXConnection* Connection, bool Explict)
+void Disconnected(const ConnectionHandle& Connection, bool Explict)
 {
 	std::cout<<"Disconnected\n";
 	Exit = true;
 }
 
-void __stdcall RecivedPacket(UDPXConnection* Connection, bool Checked, BYTE* Data, int Length)
+void RecivedPacket(const ConnectionHandle& Connection, bool Checked, const PacketView& Data)
 {
-	for(int i = 0; i < Length; i++)
-		std::cout<<((char)Data[0]);
+	for(int i = 0; i < Data.GetLength(); i++)
+		std::cout<<((char)Data.GetData()[i]);
 	std::cout<<"\n";
 }
 
-void __stdcall ConnectionHandeler(UDPXConnection* Connection)
+void Connected(const ConnectionHandle& Connection)
 {
 	if(!Connection)
 	{
@@ -51,14 +51,11 @@ int _tmain(int argc, _TCHAR* argv[])
 {
 	UDPX::InitSockets();
 	std::cout<<"Connectiong to localhost...\n";
-	UDPXAddress* addr = new UDPXAddress(127,0,0,1,(unsigned short)100);
-	addr->Port = 100;
-	printf("%i - %i\n", addr->Address, addr->Port);
-	std::cout<<addr->Address<<" - "<<addr->Port<<"\n";
-	Connect(addr, &ConnectionHandeler);
+	UDPXAddress addr(127,0,0,1,(unsigned short)100); // The Test server only listens on IPv4
+	std::cout<<addr.Address<<" - "<<addr.Port<<"\n";
+	Connect(addr, &Connected);
 	
 	while(!Exit) Sleep(100);
 	UDPX::UninitSockets();
 	return 0;
 }
-